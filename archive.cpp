@@ -0,0 +1,380 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static constexpr char archive_magic[] = {'e', 'n', 'c', 'a', 'r', 'c', 'h', '1'};
+
+namespace {
+
+struct archive_entry
+{
+   string path; // relative, with `/' between its parts
+   uint64_t size;
+};
+
+// the plaintext of an archive: its index, then the files read one after the other
+class archive_istreambuf: public streambuf
+{
+   const fs::path root;
+   const vector<archive_entry> &entries;
+   string index;
+   size_t next = 0;        // the entry whose file is read next
+   ifstream file;
+   uint64_t remaining = 0; // of the current file
+   char buffer[1 << 16];
+
+protected:
+   int_type underflow() override;
+
+public:
+   archive_istreambuf(const fs::path &root, const vector<archive_entry> &entries);
+};
+
+// writes the entries of the plaintext of an archive to their files, the
+// index being parsed a field at a time as it comes
+class archive_ostreambuf: public streambuf
+{
+   const fs::path root;
+   const string &wanted; // the only entry written, unless empty
+   vector<archive_entry> entries;
+   enum { magic, count, path_length, path, size, data } field = magic;
+   string pending;       // the bytes of the current field of the index
+   size_t need = sizeof archive_magic;
+   uint32_t nb_entries = 0;
+   size_t current = 0;   // the entry whose data comes
+   uint64_t remaining = 0;
+   ofstream file;
+   vector<string> written; // the paths of the files
+
+   void parse_field();
+   void start_entry();
+   void close_file();
+
+protected:
+   int_type overflow(int_type c) override;
+   streamsize xsputn(const char *s, streamsize n) override;
+
+public:
+   archive_ostreambuf(const fs::path &root, const string &wanted)
+      : root(root), wanted(wanted)
+   {}
+
+   // checks that the archive was complete and returns the paths of the files written
+   const vector<string> &finish();
+};
+
+}
+
+static void put_big_endian(string &s, const uint64_t value, const int bytes)
+{
+   for (int i = bytes - 1; i >= 0; --i)
+   {
+      s += static_cast<char>(value >> 8 * i);
+   }
+}
+
+static uint64_t get_big_endian(const string &s)
+{
+   uint64_t value = 0;
+   for (const char c: s)
+   {
+      value = value << 8 | static_cast<unsigned char>(c);
+   }
+   return value;
+}
+
+archive_istreambuf::archive_istreambuf(const fs::path &root, const vector<archive_entry> &entries)
+   : root(root), entries(entries)
+{
+   index.append(archive_magic, sizeof archive_magic);
+   put_big_endian(index, entries.size(), 4);
+   for (const archive_entry &e: entries)
+   {
+      put_big_endian(index, e.path.size(), 2);
+      index += e.path;
+      put_big_endian(index, e.size, 8);
+   }
+   setg(&index[0], &index[0], &index[0] + index.size());
+}
+
+archive_istreambuf::int_type archive_istreambuf::underflow()
+{
+   while (remaining == 0)
+   {
+      if (file.is_open())
+      {
+         if (file.peek() != traits_type::eof())
+         {
+            throw error(__FILE__, __LINE__, entries[next - 1].path + " grew while archiving");
+         }
+         file.close();
+      }
+      if (next == entries.size()) return traits_type::eof();
+      const archive_entry &e = entries[next++];
+      file.open(root / e.path, ios::binary);
+      if (not file)
+      {
+         throw error(__FILE__, __LINE__, "cannot open " + e.path);
+      }
+      remaining = e.size;
+   }
+
+   file.read(buffer, std::min<uint64_t>(remaining, sizeof buffer));
+   const streamsize n = file.gcount();
+   if (n == 0)
+   { // the size in the index is already encoded
+      throw error(__FILE__, __LINE__, entries[next - 1].path + " shrank while archiving");
+   }
+   remaining -= n;
+   setg(buffer, buffer, buffer + n);
+   return traits_type::to_int_type(*gptr());
+}
+
+// the regular files under root, in the order of their paths
+static vector<archive_entry> list_files(const fs::path &root)
+{
+   vector<archive_entry> entries;
+   for (const auto &item: fs::recursive_directory_iterator(root))
+   {
+      if (not item.is_symlink() and item.is_regular_file())
+      {
+         entries.push_back(archive_entry{item.path().lexically_relative(root).generic_string(), item.file_size()});
+         if (entries.back().path.size() > 0xffff)
+         {
+            throw error(__FILE__, __LINE__, "path too long for an archive: " + item.path().string());
+         }
+      }
+      else if (item.is_symlink() or not item.is_directory())
+      {
+         clog << "skipped " << item.path().string() << ", not a regular file\n";
+      }
+   }
+   sort(entries.begin(), entries.end(), [](const archive_entry &a, const archive_entry &b)
+   {
+      return a.path < b.path;
+   });
+   return entries;
+}
+
+mac_words encode_archive(const word_list &words, const string &dir, ostream &out,
+                         const cipher_id cipher, const bool with_key_id)
+{
+   const fs::path root(dir);
+   if (not fs::is_directory(root))
+   {
+      throw error(__FILE__, __LINE__, dir + " isn't a directory");
+   }
+   const vector<archive_entry> entries = list_files(root);
+
+   archive_istreambuf buffer(root, entries);
+   istream in(&buffer);
+   in.exceptions(ios::badbit); // the errors of the files go through
+   const mac_words mac = encode(words, in, out, nullptr, cipher, with_key_id);
+   clog << entries.size() << " files archived\n";
+   return mac;
+}
+
+// the file of an entry, which must stay under root, even through the
+// symbolic links already there
+static fs::path entry_file(const fs::path &root, const string &path)
+{
+   const fs::path relative(path);
+   bool safe = not relative.empty() and relative.is_relative() and not relative.has_root_name();
+   for (const auto &part: relative)
+   {
+      safe = safe and part != "..";
+   }
+   if (safe)
+   {
+      const fs::path real_root = fs::weakly_canonical(root);
+      const fs::path parent = fs::weakly_canonical((root / relative).parent_path());
+      safe = mismatch(real_root.begin(), real_root.end(), parent.begin(), parent.end()).first == real_root.end();
+   }
+   if (not safe)
+   {
+      throw error(__FILE__, __LINE__, "unsafe path in the archive: " + path);
+   }
+   return root / relative;
+}
+
+void archive_ostreambuf::parse_field()
+{
+   switch (field)
+   {
+   case magic:
+      if (pending != string(archive_magic, sizeof archive_magic))
+      {
+         throw error(__FILE__, __LINE__, "not an archive");
+      }
+      field = count;
+      need = 4;
+      break;
+   case count:
+      nb_entries = get_big_endian(pending);
+      field = path_length;
+      need = 2;
+      break;
+   case path_length:
+      field = path;
+      need = get_big_endian(pending);
+      break;
+   case path:
+      entry_file(root, pending); // before any file is written
+      entries.push_back(archive_entry{pending, 0});
+      field = size;
+      need = 8;
+      break;
+   case size:
+      entries.back().size = get_big_endian(pending);
+      field = path_length;
+      need = 2;
+      break;
+   case data:
+      break;
+   }
+   pending.clear();
+
+   if (field == path_length and entries.size() == nb_entries)
+   { // the index is complete
+      if (not wanted.empty() and none_of(entries.begin(), entries.end(), [&](const archive_entry &e)
+                                         { return e.path == wanted; }))
+      {
+         throw error(__FILE__, __LINE__, "no entry " + wanted + " in the archive");
+      }
+      field = data;
+      start_entry();
+   }
+}
+
+// opens the file of the current entry, and writes the empty ones on the way
+void archive_ostreambuf::start_entry()
+{
+   for ( ; current < entries.size(); ++current)
+   {
+      const archive_entry &e = entries[current];
+      if (wanted.empty() or e.path == wanted)
+      {
+         const fs::path file_path = entry_file(root, e.path);
+         fs::create_directories(file_path.parent_path());
+         file.open(file_path, ios::binary);
+         if (not file)
+         {
+            throw error(__FILE__, __LINE__, "cannot create " + file_path.string());
+         }
+      }
+      remaining = e.size;
+      if (remaining > 0) return;
+      close_file();
+   }
+}
+
+void archive_ostreambuf::close_file()
+{
+   if (not file.is_open()) return;
+   file.close();
+   if (not file)
+   {
+      throw error(__FILE__, __LINE__, "cannot write " + entries[current].path);
+   }
+   written.push_back(entries[current].path);
+}
+
+archive_ostreambuf::int_type archive_ostreambuf::overflow(int_type c)
+{
+   if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+   const char byte = traits_type::to_char_type(c);
+   return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+}
+
+streamsize archive_ostreambuf::xsputn(const char *const s, const streamsize n)
+{
+   for (streamsize done = 0; done < n; )
+   {
+      if (field != data)
+      {
+         const size_t take = std::min<size_t>(need - pending.size(), n - done);
+         pending.append(s + done, take);
+         done += take;
+         if (pending.size() == need) parse_field();
+         continue;
+      }
+      if (current == entries.size())
+      {
+         throw error(__FILE__, __LINE__, "data after the last entry of the archive");
+      }
+
+      const streamsize take = std::min<uint64_t>(remaining, n - done);
+      if (file.is_open() and not file.write(s + done, take))
+      {
+         throw error(__FILE__, __LINE__, "cannot write " + entries[current].path);
+      }
+      remaining -= take;
+      done += take;
+      if (remaining == 0)
+      {
+         close_file();
+         ++current;
+         start_entry();
+      }
+   }
+   return n;
+}
+
+const vector<string> &archive_ostreambuf::finish()
+{
+   if (field != data or current != entries.size())
+   {
+      throw error(__FILE__, __LINE__, "truncated archive");
+   }
+   return written;
+}
+
+void decode_archive(const word_index &words_rev, istream &in, const string &dir, const string &entry)
+{
+   const fs::path root(dir);
+   fs::create_directories(root);
+   // the files are written under a directory of their own in root, and
+   // moved to their paths only once decode() checked the final MAC
+   string staging_name = (root / ".encode-archive.XXXXXX").string();
+   if (mkdtemp(&staging_name[0]) == nullptr)
+   {
+      throw error(__FILE__, __LINE__, "cannot create a directory in " + dir);
+   }
+   const fs::path staging(staging_name);
+   try
+   {
+      vector<string> written;
+      {
+         archive_ostreambuf buffer(staging, entry);
+         ostream out(&buffer);
+         out.exceptions(ios::badbit); // the errors of the files go through
+         decode(words_rev, in, out);
+         written = buffer.finish();
+      }
+      vector<fs::path> files; // all checked before any is moved
+      for (const string &path: written)
+      {
+         files.push_back(entry_file(root, path));
+      }
+      for (size_t i = 0; i < written.size(); ++i)
+      {
+         fs::create_directories(files[i].parent_path());
+         fs::rename(staging / written[i], files[i]);
+      }
+      fs::remove_all(staging);
+      clog << written.size() << " files extracted\n";
+   }
+   catch (...)
+   { // no file is left from an archive which failed
+      error_code ignored;
+      fs::remove_all(staging, ignored);
+      throw;
+   }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// An archive is a single encoded stream of the regular files under a
+// directory. Its plaintext starts with an index: a magic, the number of
+// entries, then for each its path length (16 bits), its relative path and
+// its size (64 bits), all big-endian. The contents follow back to back in
+// the order of the index, which is that of the paths.
+
+// encodes the files under dir, with the cipher and the key id as encode() does
+mac_words encode_archive(const word_list &words, const std::string &dir, std::ostream &out,
+                         cipher_id cipher, bool with_key_id);
+// Decodes an archive into dir and the directories of its entries, which
+// are created. With entry not empty, only the file of that path is written.
+// The files only reach their paths once the whole archive is authenticated:
+// an archive which fails leaves none. A path out of dir fails, even through
+// a symbolic link in dir, as a truncated archive or an unknown entry do.
+void decode_archive(const word_index &words_rev, std::istream &in, const std::string &dir,
+                    const std::string &entry);
@@ -0,0 +1,91 @@
+#include "arena.hpp"
+
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+#include <sys/mman.h>
+
+using namespace std;
+
+static constexpr size_t huge_page_size = size_t(2) << 20;
+
+namespace {
+
+struct arena_state
+{
+   mutex lock;
+   char *next = nullptr;
+   char *end = nullptr;
+   vector<void*> free_blocks; // of block_buffer
+};
+
+arena_state &state()
+{
+   static arena_state s;
+   return s;
+}
+
+}
+
+// maps whole huge pages aligned on their size, which the kernel needs to
+// back them with huge pages
+static char *map_huge_pages(const size_t size)
+{
+   const size_t mapped = size + huge_page_size;
+   void *const p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (p == MAP_FAILED) throw bad_alloc();
+
+   const uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+   const uintptr_t aligned = (begin + huge_page_size - 1) & ~(huge_page_size - 1);
+   if (aligned > begin) munmap(p, aligned - begin);
+   const uintptr_t tail = begin + mapped - (aligned + size);
+   if (tail > 0) munmap(reinterpret_cast<void*>(aligned + size), tail);
+
+   if (getenv("ENCODE_NO_HUGEPAGES") == nullptr)
+   {
+      madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE); // a hint only
+   }
+   return reinterpret_cast<char*>(aligned);
+}
+
+void *arena_allocate(size_t size)
+{
+   size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+   arena_state &s = state();
+   lock_guard<mutex> guard(s.lock);
+   if (size > size_t(s.end - s.next))
+   { // the rest of the current mapping is left unused
+      const size_t mapped = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+      s.next = map_huge_pages(mapped);
+      s.end = s.next + mapped;
+   }
+   void *const result = s.next;
+   s.next += size;
+   return result;
+}
+
+static uint32_t *acquire_block()
+{
+   arena_state &s = state();
+   {
+      lock_guard<mutex> guard(s.lock);
+      if (not s.free_blocks.empty())
+      {
+         void *const block = s.free_blocks.back();
+         s.free_blocks.pop_back();
+         return static_cast<uint32_t*>(block);
+      }
+   }
+   return static_cast<uint32_t*>(arena_allocate(block_buffer::size + block_buffer::slack));
+}
+
+block_buffer::block_buffer()
+   : buffer(acquire_block())
+{}
+
+block_buffer::~block_buffer()
+{
+   arena_state &s = state();
+   lock_guard<mutex> guard(s.lock);
+   s.free_blocks.push_back(buffer);
+}
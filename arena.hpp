@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// Memory for the long-lived tables: mappings of whole 2 MiB huge pages,
+// advised to be backed by transparent huge pages unless ENCODE_NO_HUGEPAGES
+// is set, cut into pieces aligned for SIMD. The pieces are never given back:
+// the mappings last as long as the program.
+constexpr std::size_t arena_alignment = 64;
+void *arena_allocate(std::size_t size);
+
+// a std allocator over the arena, for the containers which are filled once
+template <class T>
+struct arena_allocator
+{
+   typedef T value_type;
+   arena_allocator() = default;
+   template <class U> arena_allocator(const arena_allocator<U>&) {}
+
+   T *allocate(const std::size_t n)
+   {
+      return static_cast<T*>(arena_allocate(n * sizeof(T)));
+   }
+   void deallocate(T*, std::size_t) {}
+
+   template <class U> bool operator==(const arena_allocator<U>&) const { return true; }
+   template <class U> bool operator!=(const arena_allocator<U>&) const { return false; }
+};
+
+// Block buffers from the arena: a released buffer is kept for the next
+// encoding or decoding, so that many of them reuse the same few buffers.
+class block_buffer
+{
+public:
+   static constexpr std::size_t size = 20480;
+   // the room after the block for what a cipher writes after the data
+   static constexpr std::size_t slack = 64;
+
+   block_buffer();
+   ~block_buffer();
+
+   std::uint32_t *data() const { return buffer; }
+
+private:
+   block_buffer(const block_buffer&) = delete;
+   block_buffer& operator= (const block_buffer&) = delete;
+
+   std::uint32_t *const buffer;
+};
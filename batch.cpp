@@ -0,0 +1,132 @@
+#include "batch.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+
+struct job
+{
+   bool decode;
+   string input, output;
+   uintmax_t size;
+   string failure;
+};
+
+}
+
+static vector<job> read_jobs(istream &manifest)
+{
+   vector<job> jobs;
+   string line;
+   for (size_t number = 1; getline(manifest, line); ++number)
+   {
+      if (line.empty() or line[0] == '#') continue;
+
+      const size_t first_tab = line.find('\t');
+      const size_t second_tab = line.find('\t', first_tab + 1);
+      const string mode = line.substr(0, first_tab);
+      if (first_tab == string::npos or second_tab == string::npos
+         or line.find('\t', second_tab + 1) != string::npos or (mode != "enc" and mode != "dec"))
+      {
+         throw error(__FILE__, __LINE__, "manifest line " + to_string(number) + " isn't: enc|dec <tab> input <tab> output");
+      }
+
+      job j{mode == "dec", line.substr(first_tab + 1, second_tab - first_tab - 1), line.substr(second_tab + 1), 0, {}};
+      error_code ignored; // a missing input fails when the job runs
+      j.size = filesystem::file_size(j.input, ignored);
+      if (j.size == static_cast<uintmax_t>(-1)) j.size = 0;
+      jobs.push_back(move(j));
+   }
+   return jobs;
+}
+
+static void run_job(const word_list &words, const word_index &words_rev, job &j)
+{
+   ifstream in(j.input, ios::binary);
+   if (not in)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + j.input);
+   }
+   ofstream out(j.output, ios::binary);
+   if (not out)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + j.output);
+   }
+   try
+   {
+      if (j.decode)
+      {
+         decode(words_rev, in, out);
+      }
+      else
+      {
+         encode(words, in, out);
+      }
+      if (not out.flush())
+      {
+         throw error(__FILE__, __LINE__, "cannot write " + j.output);
+      }
+   }
+   catch (...)
+   { // no partial or unauthenticated output
+      out.close();
+      remove(j.output.c_str());
+      throw;
+   }
+}
+
+size_t run_batch(const word_list &words, istream &manifest,
+                 ostream &report, const unsigned threads)
+{
+   vector<job> jobs = read_jobs(manifest);
+
+   word_index words_rev(words);
+   if (any_of(jobs.begin(), jobs.end(), [](const job &j) { return j.decode; }))
+   {
+      words_rev.build_table(); // once for all the jobs
+   }
+
+   // the largest first, the threads take the next job when they are done
+   vector<size_t> order(jobs.size());
+   iota(order.begin(), order.end(), 0);
+   stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b)
+   {
+      return jobs[a].size > jobs[b].size;
+   });
+
+   parallel_for(order.size(), threads, [&](const size_t i)
+   {
+      job &j = jobs[order[i]];
+      try
+      {
+         run_job(words, words_rev, j);
+      }
+      catch (const exception &exc)
+      {
+         j.failure = exc.what();
+      }
+   });
+
+   size_t failed = 0;
+   for (const job &j: jobs)
+   {
+      report << (j.failure.empty() ? "ok" : "failed") << '\t' << j.input << '\t' << j.output;
+      if (not j.failure.empty())
+      {
+         report << '\t' << j.failure;
+         ++failed;
+      }
+      report << '\n';
+   }
+   clog << jobs.size() - failed << " of " << jobs.size() << " jobs done\n";
+   return failed;
+}
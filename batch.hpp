@@ -0,0 +1,13 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Runs the jobs listed in manifest, one per line: the mode enc or dec, the
+// input file and the output file, separated by tabs. The dictionary and the
+// key are those already loaded. The largest inputs are started first on
+// `threads` threads so that none is left alone at the end.
+// One line per job is written to report, in the order of the manifest:
+// ok or failed, the input file and the output file, then the error.
+// The output of a failed job is removed. Returns the number of failures.
+std::size_t run_batch(const word_list &words, std::istream &manifest,
+                      std::ostream &report, unsigned threads);
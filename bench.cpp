@@ -0,0 +1,263 @@
+// Benchmarks of the encoding in process, without the start of a program.
+// Usage: bench latency [calls] | bench blocks [MiB]
+#include "encodetotext.hpp"
+#include "synthetic.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+static double microseconds_since(const bench_clock::time_point start)
+{
+   return chrono::duration<double, micro>(bench_clock::now() - start).count();
+}
+
+static string random_bytes(const size_t size)
+{
+   string data(size, '\0');
+   uint32_t x = 2463534242u; // xorshift32
+   for (auto &c: data)
+   {
+      x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+      c = static_cast<char>(x);
+   }
+   return data;
+}
+
+static void print_setup(const char *name, const double us)
+{
+   cout << left << setw(24) << name << right
+      << setw(12) << fixed << setprecision(1) << us << " us\n";
+}
+
+// fixed costs of a run, then the cost of each call for small messages
+static int latency(const long calls)
+{
+   auto start = bench_clock::now();
+   word_list words;
+   if (not quick_start(words))
+   {
+      generate_words(words);
+   }
+   print_setup("dictionary", microseconds_since(start));
+
+   start = bench_clock::now();
+   load_static_key();
+   print_setup("key", microseconds_since(start));
+
+   start = bench_clock::now();
+   word_index searched(words);
+   print_setup("index, search", microseconds_since(start));
+
+   start = bench_clock::now();
+   word_index hashed(words);
+   hashed.build_table();
+   print_setup("index, table", microseconds_since(start));
+
+   cout << '\n' << setw(8) << "bytes" << setw(12) << "enc us"
+      << setw(12) << "dec search" << setw(12) << "dec table" << '\n';
+   for (size_t size = 1; size <= 4096; size *= 4)
+   {
+      const string data = random_bytes(size);
+      string encoded;
+      double encode_us, search_us = 0, table_us = 0;
+      {
+         start = bench_clock::now();
+         for (long i = 0; i < calls; ++i)
+         {
+            istringstream in(data);
+            ostringstream out;
+            encode(words, in, out);
+            encoded = out.str();
+         }
+         encode_us = microseconds_since(start) / calls;
+      }
+      for (auto index: {&searched, &hashed})
+      {
+         start = bench_clock::now();
+         for (long i = 0; i < calls; ++i)
+         {
+            istringstream in(encoded);
+            ostringstream out;
+            decode(*index, in, out);
+            if (out.str() != data)
+            {
+               throw error(__FILE__, __LINE__, "decoded data differs");
+            }
+         }
+         (index == &searched ? search_us : table_us) = microseconds_since(start) / calls;
+      }
+      cout << setw(8) << size << setprecision(2)
+         << setw(12) << encode_us << setw(12) << search_us << setw(12) << table_us << '\n';
+   }
+   return 0;
+}
+
+namespace {
+
+// the L1 data cache misses of this thread, when the kernel lets us count them
+class cache_misses
+{
+   int fd;
+
+public:
+   cache_misses()
+   {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof attr);
+      attr.size = sizeof attr;
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8
+         | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+   }
+   ~cache_misses()
+   {
+      if (fd >= 0) close(fd);
+   }
+   cache_misses(const cache_misses&) = delete;
+   cache_misses& operator=(const cache_misses&) = delete;
+
+   bool available() const { return fd >= 0; }
+
+   uint64_t count() const
+   {
+      uint64_t value = 0;
+      if (fd < 0 or ::read(fd, &value, sizeof value) != sizeof value) return 0;
+      return value;
+   }
+};
+
+// reads a string in place, without the copy of an istringstream
+class memory_streambuf: public streambuf
+{
+public:
+   explicit memory_streambuf(const string &data)
+   {
+      char *const begin = const_cast<char*>(data.data());
+      setg(begin, begin, begin + data.size());
+   }
+};
+
+// drops what is written, so that only the encoding is timed
+class null_streambuf: public streambuf
+{
+   char buffer[1 << 16];
+
+protected:
+   int_type overflow(int_type c) override
+   {
+      setp(buffer, buffer + sizeof buffer);
+      return traits_type::not_eof(c);
+   }
+   streamsize xsputn(const char*, const streamsize n) override
+   {
+      return n;
+   }
+};
+
+}
+
+static void print_throughput(const char *name, const size_t bytes, const double us,
+                             const cache_misses &misses, const uint64_t miss_count)
+{
+   cout << left << setw(8) << name << right << setw(10) << fixed << setprecision(1)
+      << bytes / us << " MB/s";
+   if (misses.available())
+      cout << setw(10) << setprecision(3) << double(miss_count) / bytes << " L1D misses/byte";
+   cout << '\n';
+}
+
+// throughput of whole blocks with each cipher, and the cache misses of each byte
+static int blocks(const size_t mebibytes)
+{
+   word_list words;
+   if (not quick_start(words))
+   {
+      generate_words(words);
+   }
+   load_static_key();
+   word_index words_rev(words);
+   words_rev.build_table();
+
+   const cache_misses misses;
+   if (not misses.available())
+   {
+      cout << "no L1D miss counter, times only\n";
+   }
+
+   // the data is generated as it is read, so only the encoded copy is held
+   const synthetic_data random(synthetic_data::random);
+   const size_t data_size = mebibytes << 20;
+   for (const cipher_id cipher: {cipher_id::xxtea, cipher_id::aes})
+   {
+      if (cipher == cipher_id::aes and not aes_available()) continue;
+      const string suffix = cipher == cipher_id::xxtea ? "" : string(" ") + cipher_name(cipher);
+      string encoded;
+      {
+         ostringstream out;
+         generator_streambuf data_buffer(random, data_size);
+         istream in(&data_buffer);
+         encode(words, in, out, nullptr, cipher);
+         encoded = out.str();
+      }
+
+      generator_streambuf data_buffer(random, data_size);
+      istream data_in(&data_buffer);
+      null_streambuf sink;
+      ostream null_out(&sink);
+      uint64_t before = misses.count();
+      auto start = bench_clock::now();
+      encode(words, data_in, null_out, nullptr, cipher);
+      print_throughput(("enc" + suffix).c_str(), data_size, microseconds_since(start), misses, misses.count() - before);
+
+      // the decoded data is checked as it comes, which costs a comparison
+      memory_streambuf encoded_buffer(encoded);
+      istream encoded_in(&encoded_buffer);
+      verifying_streambuf check(random, data_size);
+      ostream check_out(&check);
+      before = misses.count();
+      start = bench_clock::now();
+      decode(words_rev, encoded_in, check_out);
+      print_throughput(("dec" + suffix).c_str(), data_size, microseconds_since(start), misses, misses.count() - before);
+      if (not check.matches())
+      {
+         throw error(__FILE__, __LINE__, "decoded data differs");
+      }
+   }
+   return 0;
+}
+
+static int bench(int argc, char *argv[])
+{
+   const string mode = argc > 1 ? argv[1] : "";
+   const long count = argc > 2 ? atol(argv[2]) : mode == "blocks" ? 64 : 1000;
+   if (mode != "latency" and mode != "blocks")
+   {
+      cerr << "usage: bench latency [calls] | bench blocks [MiB]\n";
+      return 1;
+   }
+   if (count <= 0)
+   {
+      cerr << "the count must be a positive number\n";
+      return 2;
+   }
+   clog.rdbuf(nullptr); // the messages of the setup would be timed
+   return mode == "latency" ? latency(count) : blocks(count);
+}
+
+int (*run)(int argc, char *argv[]) = bench;
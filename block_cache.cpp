@@ -0,0 +1,59 @@
+#include "block_cache.hpp"
+
+#include <cstring>
+#include <ostream>
+
+using namespace std;
+
+uint64_t block_hash(const char *block, const size_t size)
+{
+   uint64_t h = size;
+   size_t i = 0;
+   for ( ; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+   {
+      uint64_t v;
+      memcpy(&v, block + i, sizeof v);
+      h = (h ^ v) * 0x9e3779b97f4a7c15u;
+      h ^= h >> 32;
+   }
+   for ( ; i < size; ++i)
+   {
+      h = (h ^ static_cast<unsigned char>(block[i])) * 0x9e3779b97f4a7c15u;
+   }
+   return h;
+}
+
+block_cache::block_cache(const size_t entries)
+   : entries(entries ? entries : 1)
+{}
+
+block_cache::entry &block_cache::lookup(const char *block, const size_t size, bool &hit)
+{
+   const uint64_t hash = block_hash(block, size);
+   entry &e = entries[hash % entries.size()];
+   ++lookups;
+   // the value is filled last: an entry left empty by an error isn't found
+   hit = e.hash == hash and not e.value.empty()
+      and e.key.size() == size and memcmp(e.key.data(), block, size) == 0;
+   if (hit)
+   {
+      ++hits;
+      saved_bytes += size;
+   }
+   else
+   {
+      e.hash = hash;
+      e.key.assign(block, size);
+      e.natives.clear();
+      e.value.clear();
+   }
+   return e;
+}
+
+void block_cache::report(ostream &out) const
+{
+   const uint64_t per_mille = lookups ? hits * 1000 / lookups : 0;
+   out << "dedup: " << hits << " of " << lookups << " blocks repeated ("
+      << per_mille / 10 << '.' << per_mille % 10 << "%), "
+      << saved_bytes << " bytes not encrypted again\n";
+}
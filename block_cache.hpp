@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// a multiply-shift over the 64-bit words of a block, fast enough to be
+// paid by every block, but not meant to resist crafted collisions
+std::uint64_t block_hash(const char *block, std::size_t size);
+
+/**
+ * The last distinct blocks seen and what they became. With a fixed key, the
+ * encryption of a block doesn't depend on its place, so a repeated block may
+ * skip the cipher and the rendering of its words: only the MAC goes through
+ * it again. A block is only found if all of its bytes are equal, not just
+ * its hash.
+ */
+class block_cache
+{
+public:
+   struct entry
+   {
+      std::uint64_t hash = 0;
+      std::string key;                   // the block as given to lookup()
+      std::vector<std::uint32_t> natives; // enc: the encrypted integers
+      std::string value;                 // enc: the words, dec: the plaintext
+   };
+
+   explicit block_cache(std::size_t entries = 16);
+
+   // returns the entry of the block: when it wasn't found, it is emptied
+   // and given the block as key, for the caller to fill, value last
+   entry &lookup(const char *block, std::size_t size, bool &hit);
+
+   // the hits and the bytes that skipped the cipher
+   void report(std::ostream &out) const;
+
+private:
+   std::vector<entry> entries;
+   std::uint64_t lookups = 0, hits = 0, saved_bytes = 0;
+};
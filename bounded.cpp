@@ -0,0 +1,87 @@
+#include "bounded.hpp"
+
+#include <limits>
+
+using namespace std;
+
+namespace {
+
+// reads from another stream buffer and fails past a number of bytes
+class bounded_istreambuf: public streambuf
+{
+   streambuf *const source;
+   const streamsize limit;
+   streamsize remaining;
+   char buffer[1 << 16];
+
+protected:
+   int_type underflow() override
+   {
+      const streamsize n = source->sgetn(buffer, sizeof buffer);
+      if (n <= 0) return traits_type::eof();
+      if (n > remaining)
+      {
+         throw error(__FILE__, __LINE__, "the input is over the limit of " + to_string(limit) + " bytes");
+      }
+      remaining -= n;
+      setg(buffer, buffer, buffer + n);
+      return traits_type::to_int_type(*gptr());
+   }
+
+public:
+   bounded_istreambuf(streambuf *source, streamsize limit)
+      : source(source), limit(limit), remaining(limit)
+   {}
+};
+
+// writes to another stream buffer and fails past a number of bytes
+class bounded_ostreambuf: public streambuf
+{
+   streambuf *const sink;
+   const streamsize limit;
+   streamsize remaining;
+
+protected:
+   int_type overflow(int_type c) override
+   {
+      if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+      const char byte = traits_type::to_char_type(c);
+      return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+   }
+
+   streamsize xsputn(const char *s, const streamsize n) override
+   {
+      if (n > remaining)
+      {
+         throw error(__FILE__, __LINE__, "the output is over the limit of " + to_string(limit) + " bytes");
+      }
+      remaining -= n;
+      return sink->sputn(s, n);
+   }
+
+   int sync() override
+   {
+      return sink->pubsync();
+   }
+
+public:
+   bounded_ostreambuf(streambuf *sink, streamsize limit)
+      : sink(sink), limit(limit), remaining(limit)
+   {}
+};
+
+}
+
+mac_words decode_bounded(const word_index &words_rev, istream &in, ostream &out,
+                         const streamsize max_input, const streamsize max_output, const bool raw)
+{
+   constexpr streamsize unlimited = numeric_limits<streamsize>::max();
+   bounded_istreambuf in_buffer(in.rdbuf(), max_input ? max_input : unlimited);
+   bounded_ostreambuf out_buffer(out.rdbuf(), max_output ? max_output : unlimited);
+   istream bounded_in(&in_buffer);
+   ostream bounded_out(&out_buffer);
+   // the errors of the stream buffers go through the streams
+   bounded_in.exceptions(ios::badbit);
+   bounded_out.exceptions(ios::badbit);
+   return raw ? decode_raw(bounded_in, bounded_out) : decode(words_rev, bounded_in, bounded_out);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Decodes in like decode(), or decode_raw() when raw, for untrusted input:
+// it fails as soon as more than max_input bytes are read or more than
+// max_output bytes are written, when they aren't 0. The memory used doesn't
+// depend on the input, since a word is dropped past its 8 bytes.
+mac_words decode_bounded(const word_index &words_rev, std::istream &in, std::ostream &out,
+                         std::streamsize max_input, std::streamsize max_output, bool raw);
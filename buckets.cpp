@@ -1,47 +1,362 @@
+// Benchmark of the candidate structures for the reverse lookup of decode():
+// word -> index in the 65536-word dictionary.
+// Usage: buckets [lookups] [dump]
 #include"encodetotext.hpp"
 #include<vector>
 #include<iostream>
-#include<fstream>
+#include<iomanip>
 #include<unordered_map>
+#include<map>
 #include<cassert>
 #include<algorithm>
 #include<cmath>
-int main()
+#include<chrono>
+#include<cstdlib>
+#include<new>
+
+namespace
+{
+
+// counts the bytes allocated by a container for the memory footprint
+std::size_t allocated_bytes = 0;
+
+template <class T>
+struct counting_allocator
+{
+	typedef T value_type;
+	counting_allocator() = default;
+	template <class U> counting_allocator(const counting_allocator<U>&) {}
+	T* allocate(std::size_t n)
+	{
+		allocated_bytes += n * sizeof(T);
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+	void deallocate(T* p, std::size_t n)
+	{
+		allocated_bytes -= n * sizeof(T);
+		::operator delete(p);
+	}
+	template <class U> bool operator == (const counting_allocator<U>&) const { return true; }
+	template <class U> bool operator != (const counting_allocator<U>&) const { return false; }
+};
+
+// candidate hash functions on the packed word
+std::uint64_t multiply_shift(std::uint64_t v)
+{
+	return v * 0x9e3779b97f4a7c15u;
+}
+
+std::uint64_t rotate_xor(std::uint64_t v) // the former std::hash<small_string>
+{
+	std::uint32_t h = 0x9e3779b9;
+	for (; v; v <<= 8)
+	{
+		h ^= static_cast<char>(v >> 56);
+		h = (h << 7) ^ (h >> 25);
+	}
+	return std::uint64_t(h) * 0x9e3779b97f4a7c15u; // spread to the high bits used for the slot
+}
+
+std::uint64_t murmur_mix(std::uint64_t v) // finalizer of MurmurHash3
+{
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdu;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53u;
+	v ^= v >> 33;
+	return v;
+}
+
+typedef std::uint64_t (*hash_function)(std::uint64_t);
+
+// linear probing in a power of 2 table indexed by the high bits of the hash
+class open_addressing
+{
+	static constexpr int bits = 17; // load factor 0.5
+	struct slot { std::uint64_t key; std::uint16_t index; };
+	std::vector<slot> table;
+	hash_function hash;
+public:
+	open_addressing(const word_list &words, hash_function hash)
+		: table(std::size_t(1) << bits, slot{0, 0}), hash(hash)
+	{
+		std::uint16_t j = 0;
+		for (auto &word: words)
+		{
+			std::size_t i = hash(word.value) >> (64 - bits);
+			while (table[i].key != 0)
+				i = (i + 1) & (table.size() - 1);
+			table[i] = slot{word.value, j++};
+		}
+	}
+	int probes(const small_string &word) const
+	{
+		int n = 1;
+		for (std::size_t i = hash(word.value) >> (64 - bits); table[i].key != word.value; i = (i + 1) & (table.size() - 1))
+			++n;
+		return n;
+	}
+	int find(const small_string &word) const
+	{
+		for (std::size_t i = hash(word.value) >> (64 - bits); ; i = (i + 1) & (table.size() - 1))
+		{
+			if (table[i].key == word.value) return table[i].index;
+			if (table[i].key == 0) return -1;
+		}
+	}
+	std::size_t bytes() const { return table.size() * sizeof(slot); }
+};
+
+// hash and displace: each first level bucket gets the seed that sends all
+// its words to free slots, so that a lookup is always a single probe
+class perfect_hash
+{
+	static constexpr int bucket_bits = 14, bits = 17;
+	std::vector<std::uint16_t> seeds;
+	std::vector<std::uint64_t> keys;
+	std::vector<std::uint16_t> indices;
+	static std::size_t slot(std::uint64_t v, std::uint16_t seed)
+	{
+		return murmur_mix(v ^ (seed * 0xc2b2ae3d27d4eb4fu)) >> (64 - bits);
+	}
+public:
+	explicit perfect_hash(const word_list &words)
+		: seeds(std::size_t(1) << bucket_bits), keys(std::size_t(1) << bits), indices(keys.size())
+	{
+		std::vector<std::vector<std::uint16_t>> buckets(seeds.size());
+		for (std::size_t j = 0; j < words.size(); ++j)
+			buckets[multiply_shift(words[j].value) >> (64 - bucket_bits)].push_back(j);
+		std::vector<std::size_t> order(buckets.size());
+		for (std::size_t b = 0; b < order.size(); ++b) order[b] = b;
+		std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return buckets[a].size() > buckets[b].size(); });
+		std::vector<std::size_t> slots;
+		for (const auto b: order)
+		{
+			for (std::uint16_t seed = 0; ; ++seed)
+			{
+				assert(seed != 0xffff);
+				slots.clear();
+				bool ok = true;
+				for (const auto j: buckets[b])
+				{
+					const auto s = slot(words[j].value, seed);
+					ok = keys[s] == 0 and std::find(slots.begin(), slots.end(), s) == slots.end();
+					if (not ok) break;
+					slots.push_back(s);
+				}
+				if (not ok) continue;
+				for (std::size_t k = 0; k < slots.size(); ++k)
+				{
+					keys[slots[k]] = words[buckets[b][k]].value;
+					indices[slots[k]] = buckets[b][k];
+				}
+				seeds[b] = seed;
+				break;
+			}
+		}
+	}
+	int find(const small_string &word) const
+	{
+		const auto s = slot(word.value, seeds[multiply_shift(word.value) >> (64 - bucket_bits)]);
+		return keys[s] == word.value ? indices[s] : -1;
+	}
+	std::size_t bytes() const
+	{
+		return seeds.size() * sizeof seeds[0] + keys.size() * sizeof keys[0] + indices.size() * sizeof indices[0];
+	}
+};
+
+// the dictionary is in decreasing order: search it directly
+int sorted_find(const word_list &words, const small_string &word)
+{
+	const auto it = std::lower_bound(words.begin(), words.end(), word,
+		[](const small_string &a, const small_string &b) { return b < a; });
+	return it != words.end() and *it == word ? int(it - words.begin()) : -1;
+}
+
+// the words compared by sorted_find, the last one being the word found
+int sorted_probes(const word_list &words, const small_string &word)
+{
+	int n = 1;
+	std::lower_bound(words.begin(), words.end(), word,
+		[&n](const small_string &a, const small_string &b) { ++n; return b < a; });
+	return n;
+}
+
+// ciphertext is uniformly distributed, and so are the words of an encoded stream
+std::vector<small_string> word_stream(const word_list &words, std::size_t n)
+{
+	std::vector<small_string> stream(n);
+	std::uint32_t x = 2463534242u; // xorshift32
+	for (auto &w: stream)
+	{
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		w = words[x & 0xffff];
+	}
+	return stream;
+}
+
+double milliseconds_since(const std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Find>
+void time_lookups(const char *name, const std::vector<small_string> &stream, std::size_t bytes, double build_ms, Find find)
+{
+	const auto start = std::chrono::steady_clock::now();
+	long checksum = 0;
+	for (auto &w: stream)
+		checksum += find(w);
+	const std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+	std::cout << std::left << std::setw(28) << name << std::right
+		<< std::setw(10) << bytes / 1024 << " KiB"
+		<< std::setw(10) << std::fixed << std::setprecision(2) << build_ms << " ms build"
+		<< std::setw(10) << std::fixed << std::setprecision(1) << stream.size() / duration.count() / 1e6 << " M lookups/s"
+		<< "  (checksum " << checksum << ")\n";
+}
+
+void print_histogram(const char *name, const std::vector<std::size_t> &histogram)
+{
+	double sum = 0, count = 0;
+	for (std::size_t i = 0; i < histogram.size(); ++i)
+	{
+		sum += double(i) * histogram[i];
+		count += histogram[i];
+	}
+	std::cout << std::left << std::setw(28) << name << std::right << "mean " << std::setprecision(3) << sum / count << " ;";
+	for (std::size_t i = 1; i < histogram.size(); ++i)
+		if (histogram[i])
+			std::cout << ' ' << i << ':' << histogram[i];
+	std::cout << '\n';
+}
+
+}
+
+int main(int argc, char *argv[])
 {
 	std::ios::sync_with_stdio(false);
-	std::unordered_map<small_string, unsigned short> h;
-	std::ifstream wf("words.quickstart");
-	small_string w;
-	h.reserve(wf.good() << 16);
+	const std::size_t lookups = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 1 << 24;
+	const bool dump = argc > 2 and std::string(argv[2]) == "dump";
+
+	word_list words;
+	if ( ! quick_start(words))
+	{
+		generate_words(words);
+		save_words(words);
+	}
+	assert(std::is_sorted(words.rbegin(), words.rend()));
+
+	std::vector<double> build_ms;
+	auto start = std::chrono::steady_clock::now();
+	allocated_bytes = 0;
+	std::unordered_map<small_string, unsigned short, std::hash<small_string>, std::equal_to<small_string>,
+		counting_allocator<std::pair<const small_string, unsigned short>>> h;
+	h.reserve(1 << 16);
 	unsigned short j = 0;
-	while(wf >> w)
+	for (auto &w: words)
 	{
 		h[w] = j++;
 	}
 	assert(j == 0);
-	std::vector<decltype(h.bucket_size(0))> bucket_sizes;
-	bucket_sizes.reserve(h.bucket_count());
-	double sum_sq = 0;
+	const std::size_t unordered_map_bytes = allocated_bytes;
+	build_ms.push_back(milliseconds_since(start));
+
+	std::vector<std::size_t> bucket_histogram;
 	for (decltype(h.bucket_count()) b = 0; b < h.bucket_count(); ++b)
 	{
 		const auto bsize = h.bucket_size(b);
-		sum_sq += double(bsize) * double(bsize);
-		bucket_sizes.push_back(bsize);
-		std::clog << '[' << b << "] " << bsize << ": ";
-		for (auto it = h.cbegin(b); it != h.cend(b); ++it)
+		if (bsize >= bucket_histogram.size()) bucket_histogram.resize(bsize + 1);
+		++bucket_histogram[bsize];
+		if (dump)
 		{
-			std::clog << it->first << '(' << it->second << ") ";
+			std::clog << '[' << b << "] " << bsize << ": ";
+			for (auto it = h.cbegin(b); it != h.cend(b); ++it)
+			{
+				std::clog << it->first << '(' << it->second << ") ";
+			}
+			std::clog << '\n';
 		}
-		std::clog << '\n';
 	}
 	std::clog << std::flush; // this wouldn't be needed with std::cerr remarquably
 
-	const double bucket_size_stddev = std::sqrt(sum_sq / h.bucket_count() -
-		h.load_factor() * h.load_factor());
-	std::cout << "\nload_factor: " << h.load_factor()
-		<< " ; max: " << h.max_load_factor() << std::endl;
-	std::sort(bucket_sizes.begin(), bucket_sizes.end());
-	std::cout << "max_bucket_size: " << bucket_sizes.back()
-		<< " ; median: " << bucket_sizes[bucket_sizes.size() / 2] // h.bucket_count() is most probably odd
-		<< " ; stddev: " << bucket_size_stddev << '\n';
+	// probes of a successful lookup: the position of the word in its bucket
+	std::vector<std::size_t> chain_histogram;
+	for (std::size_t bsize = 1; bsize < bucket_histogram.size(); ++bsize)
+	{
+		if (bsize >= chain_histogram.size()) chain_histogram.resize(bsize + 1);
+		for (std::size_t k = 1; k <= bsize; ++k)
+			chain_histogram[k] += bucket_histogram[bsize];
+	}
+
+	std::cout << "unordered_map load_factor: " << h.load_factor()
+		<< " ; max: " << h.max_load_factor() << " ; buckets: " << h.bucket_count() << '\n';
+
+	start = std::chrono::steady_clock::now();
+	allocated_bytes = 0;
+	std::map<small_string, unsigned short, std::less<small_string>,
+		counting_allocator<std::pair<const small_string, unsigned short>>> m;
+	j = 0;
+	for (auto &w: words)
+	{
+		m[w] = j++;
+	}
+	const std::size_t map_bytes = allocated_bytes;
+	build_ms.push_back(milliseconds_since(start));
+
+	const hash_function hashes[] = {multiply_shift, rotate_xor, murmur_mix};
+	const char *const hash_names[] = {"open addressing/mulshift", "open addressing/rotxor", "open addressing/murmur"};
+	std::vector<open_addressing> tables;
+	for (auto hash: hashes)
+	{
+		start = std::chrono::steady_clock::now();
+		tables.emplace_back(words, hash);
+		build_ms.push_back(milliseconds_since(start));
+	}
+	start = std::chrono::steady_clock::now();
+	const perfect_hash perfect(words);
+	build_ms.push_back(milliseconds_since(start));
+	build_ms.push_back(0); // the sorted array is the dictionary itself
+
+	std::cout << "\nprobes per successful lookup (probes:words)\n";
+	print_histogram("unordered_map chain", chain_histogram);
+	for (std::size_t t = 0; t < tables.size(); ++t)
+	{
+		std::vector<std::size_t> histogram;
+		for (auto &w: words)
+		{
+			const std::size_t p = tables[t].probes(w);
+			if (p >= histogram.size()) histogram.resize(p + 1);
+			++histogram[p];
+		}
+		print_histogram(hash_names[t], histogram);
+	}
+	print_histogram("perfect hash", {0, words.size()});
+	std::vector<std::size_t> sorted_histogram;
+	for (auto &w: words)
+	{
+		const std::size_t p = sorted_probes(words, w);
+		if (p >= sorted_histogram.size()) sorted_histogram.resize(p + 1);
+		++sorted_histogram[p];
+	}
+	print_histogram("sorted array", sorted_histogram);
+
+	for (auto &w: words)
+	{
+		const int index = &w - &words[0];
+		if (perfect.find(w) != index or sorted_find(words, w) != index or tables[0].find(w) != index)
+		{
+			std::cerr << "lookup mismatch for " << w << '\n';
+			return 1;
+		}
+	}
+
+	const auto stream = word_stream(words, lookups);
+	std::cout << '\n' << lookups << " lookups of uniformly distributed words\n";
+	time_lookups("unordered_map", stream, unordered_map_bytes, build_ms[0], [&](const small_string &w) { return h.find(w)->second; });
+	time_lookups("map", stream, map_bytes, build_ms[1], [&](const small_string &w) { return m.find(w)->second; });
+	for (std::size_t t = 0; t < tables.size(); ++t)
+		time_lookups(hash_names[t], stream, tables[t].bytes(), build_ms[2 + t], [&](const small_string &w) { return tables[t].find(w); });
+	time_lookups("perfect hash", stream, perfect.bytes(), build_ms[2 + tables.size()], [&](const small_string &w) { return perfect.find(w); });
+	time_lookups("sorted array", stream, words.size() * sizeof(small_string), build_ms.back(), [&](const small_string &w) { return sorted_find(words, w); });
 }
@@ -0,0 +1,341 @@
+#include "checkpoint.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char checkpoint_magic[] = "encodetotext-checkpoint";
+static constexpr int checkpoint_version = 2;
+static constexpr uint64_t hash_basis = 0xcbf29ce484222325;
+
+namespace {
+
+// the files a checkpoint was taken from: resuming with others would splice
+// two encodings into a stream whose MACs are valid
+struct checkpoint_origin
+{
+   enum { input_size, input_device, input_inode, input_mtime, output_hash, nb_values };
+   uint64_t values[nb_values] = {}; // all 0 for the state of an append
+};
+
+}
+
+static streamsize input_offset(const resume_point &c)
+{
+   return c.blocks * BUFFER_SIZE;
+}
+
+// ties the values to the key, which must not change between runs
+static mac_words check(const resume_point &c, const checkpoint_origin &origin)
+{
+   uint32 data[4 + CbcMac::stateSize + 2 * checkpoint_origin::nb_values] = {
+      uint32(c.blocks >> 32), uint32(c.blocks), uint32(c.output_offset >> 32), uint32(c.output_offset)
+   };
+   copy(&c.mac_state[0], &c.mac_state[CbcMac::stateSize], data + 4);
+   for (int i = 0; i < checkpoint_origin::nb_values; ++i)
+   {
+      data[4 + CbcMac::stateSize + 2 * i] = uint32(origin.values[i] >> 32);
+      data[4 + CbcMac::stateSize + 2 * i + 1] = uint32(origin.values[i]);
+   }
+   return authenticate(data, sizeof data / sizeof *data);
+}
+
+// the size, the inode and the modification time of the input, "-" being stdin
+static void stat_input(const string &input_file, checkpoint_origin &origin)
+{
+   struct stat input_stat;
+   if ((input_file == "-" ? fstat(STDIN_FILENO, &input_stat) : stat(input_file.c_str(), &input_stat)) != 0)
+   {
+      throw error(__FILE__, __LINE__, "cannot stat " + input_file);
+   }
+   origin.values[checkpoint_origin::input_size] = input_stat.st_size;
+   origin.values[checkpoint_origin::input_device] = input_stat.st_dev;
+   origin.values[checkpoint_origin::input_inode] = input_stat.st_ino;
+   origin.values[checkpoint_origin::input_mtime] = uint64_t(input_stat.st_mtim.tv_sec) * 1000000000
+      + input_stat.st_mtim.tv_nsec;
+}
+
+// FNV-1a of the bytes of the output from begin to end, continuing hash
+static uint64_t hash_output(const string &output_file, streamsize begin, const streamsize end, uint64_t hash)
+{
+   ifstream in(output_file, ios::binary);
+   in.seekg(begin);
+   char buffer[1 << 16];
+   for (streamsize n; begin < end; begin += n)
+   {
+      in.read(buffer, std::min<streamsize>(sizeof buffer, end - begin));
+      n = in.gcount();
+      if (n == 0)
+      {
+         throw error(__FILE__, __LINE__, output_file + " is shorter than its checkpoint");
+      }
+      for (streamsize i = 0; i < n; ++i)
+      {
+         hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 0x100000001b3;
+      }
+   }
+   return hash;
+}
+
+static string checkpoint_name(const string &output_file)
+{
+   return output_file + ".checkpoint";
+}
+
+static string append_state_name(const string &output_file)
+{
+   return output_file + ".append";
+}
+
+// flushes the data of a file to the disk
+static void sync_file(const string &file)
+{
+   const int fd = open(file.c_str(), O_RDONLY);
+   if (fd < 0 or fsync(fd) != 0)
+   {
+      if (fd >= 0) close(fd);
+      throw error(__FILE__, __LINE__, "cannot sync " + file);
+   }
+   close(fd);
+}
+
+static void save_checkpoint(const string &name, const resume_point &c, const checkpoint_origin &origin)
+{
+   const string temp_name = name + ".tmp";
+   {
+      ofstream out(temp_name);
+      out << checkpoint_magic << ' ' << checkpoint_version << '\n'
+          << c.blocks << ' ' << c.output_offset << '\n';
+      for (const uint32 x: c.mac_state)
+      {
+         out << x << ' ';
+      }
+      out << '\n';
+      for (const uint64_t x: origin.values)
+      {
+         out << x << ' ';
+      }
+      out << '\n';
+      for (const uint16_t w: check(c, origin))
+      {
+         out << w << ' ';
+      }
+      out << '\n';
+      if (not out.flush())
+      {
+         throw error(__FILE__, __LINE__, "cannot write " + temp_name);
+      }
+   }
+   sync_file(temp_name);
+   // the previous checkpoint stays valid until the new one replaces it
+   if (rename(temp_name.c_str(), name.c_str()) != 0)
+   {
+      throw error(__FILE__, __LINE__, "cannot replace " + name);
+   }
+}
+
+static resume_point load_checkpoint(const string &name, checkpoint_origin &origin)
+{
+   ifstream in(name);
+   if (not in)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + name);
+   }
+
+   string magic;
+   int version = 0;
+   resume_point c;
+   mac_words expected_check;
+   in >> magic >> version >> c.blocks >> c.output_offset;
+   for (uint32 &x: c.mac_state)
+   {
+      in >> x;
+   }
+   for (uint64_t &x: origin.values)
+   {
+      in >> x;
+   }
+   for (uint16_t &w: expected_check)
+   {
+      in >> w;
+   }
+   if (not in or magic != checkpoint_magic or version != checkpoint_version)
+   {
+      throw error(__FILE__, __LINE__, "invalid checkpoint " + name);
+   }
+   if (expected_check != check(c, origin) or c.blocks < 0)
+   {
+      throw error(__FILE__, __LINE__, "checkpoint " + name + " is corrupted or from another key");
+   }
+   return c;
+}
+
+// Saves the point where the encoding may continue once the output is synced.
+// With hashed, the bytes of the output in the hash of origin, the hash is
+// brought up to that point first.
+static void save_resume_point(const string &name, const Encoder &encoder,
+                              const string &output_file, ostream &out,
+                              checkpoint_origin &origin, streamsize *const hashed)
+{
+   resume_point c;
+   c.blocks = encoder.blocks();
+   if (not out.flush() or (c.output_offset = out.tellp()) < 0)
+   {
+      throw error(__FILE__, __LINE__, "cannot write " + output_file);
+   }
+   copy(&encoder.macState()[0], &encoder.macState()[CbcMac::stateSize], c.mac_state);
+   sync_file(output_file);
+   if (hashed)
+   {
+      origin.values[checkpoint_origin::output_hash] =
+         hash_output(output_file, *hashed, c.output_offset, origin.values[checkpoint_origin::output_hash]);
+      *hashed = c.output_offset;
+   }
+   save_checkpoint(name, c, origin);
+}
+
+static void truncate_output(const string &output_file, ostream &out, const streamsize offset)
+{
+   struct stat output_stat;
+   if (stat(output_file.c_str(), &output_stat) != 0 or output_stat.st_size < offset)
+   {
+      throw error(__FILE__, __LINE__, output_file + " is shorter than its checkpoint");
+   }
+   if (truncate(output_file.c_str(), offset) != 0 or not out.seekp(offset))
+   {
+      throw error(__FILE__, __LINE__, "cannot truncate " + output_file);
+   }
+}
+
+void discard_checkpoint(const string &output_file)
+{
+   remove(checkpoint_name(output_file).c_str());
+}
+
+mac_words encode_with_checkpoints(const word_list &words,
+                                  const string &input_file, istream &in,
+                                  const string &output_file, ostream &out,
+                                  const streamsize interval, const bool resume)
+{
+   if (output_file == "-")
+   {
+      throw error(__FILE__, __LINE__, "checkpoints need a named output file");
+   }
+
+   const string name = checkpoint_name(output_file);
+   checkpoint_origin origin;
+   stat_input(input_file, origin);
+   origin.values[checkpoint_origin::output_hash] = hash_basis;
+   streamsize hashed = 0; // the bytes of the output in the hash
+   Encoder encoder(words, out);
+   if (resume)
+   {
+      checkpoint_origin saved;
+      const resume_point c = load_checkpoint(name, saved);
+      if (c.blocks < 1)
+      {
+         throw error(__FILE__, __LINE__, "checkpoint " + name + " is before the first block");
+      }
+      if (not equal(saved.values, saved.values + checkpoint_origin::output_hash, origin.values))
+      {
+         throw error(__FILE__, __LINE__, "checkpoint " + name + " was taken from another input or "
+                     + input_file + " changed since");
+      }
+      origin.values[checkpoint_origin::output_hash] = hash_output(output_file, 0, c.output_offset, hash_basis);
+      if (origin.values[checkpoint_origin::output_hash] != saved.values[checkpoint_origin::output_hash])
+      {
+         throw error(__FILE__, __LINE__, output_file + " changed since its checkpoint " + name);
+      }
+      hashed = c.output_offset;
+      truncate_output(output_file, out, c.output_offset);
+      if (not in.seekg(input_offset(c)))
+      {
+         throw error(__FILE__, __LINE__, "cannot seek the input to the checkpoint");
+      }
+      encoder.resume(c.mac_state, c.blocks);
+      clog << "resuming after " << input_offset(c) << " bytes of input\n";
+   }
+
+   const streamsize blocks_per_checkpoint = std::max<streamsize>(1, interval / BUFFER_SIZE);
+   while (in.good()) // until fail() or eof()
+   {
+      const streamsize blocks = encoder.blocks();
+      encoder.read(in);
+      if (encoder.blocks() != blocks and encoder.blocks() % blocks_per_checkpoint == 0)
+      {
+         save_resume_point(name, encoder, output_file, out, origin, &hashed);
+      }
+   }
+
+   const mac_words final_mac = encoder.finish();
+   if (not out.flush())
+   {
+      throw error(__FILE__, __LINE__, "cannot write " + output_file);
+   }
+   remove(name.c_str());
+   return final_mac;
+}
+
+mac_words encode_append(const word_list &words,
+                        const word_index &words_rev,
+                        istream &in,
+                        const string &output_file, ostream &out)
+{
+   if (output_file == "-")
+   {
+      throw error(__FILE__, __LINE__, "appending needs a named output file");
+   }
+
+   const string name = append_state_name(output_file);
+   Encoder encoder(words, out);
+   struct stat output_stat;
+   if (stat(output_file.c_str(), &output_stat) == 0 and output_stat.st_size > 0)
+   {
+      ifstream encoded(output_file, ios::binary);
+      resume_point c;
+      checkpoint_origin origin;
+      bool reopened = false;
+      try
+      { // the state saved by the last append
+         c = load_checkpoint(name, origin);
+         encoded.seekg(c.output_offset);
+         encoder.reopen(words_rev, encoded, c.mac_state, c.blocks);
+         reopened = true;
+      }
+      catch (const exception &exc)
+      {
+         clog << "no usable append state (" << exc.what() << "), reading " << output_file << " through\n";
+      }
+      if (not reopened)
+      { // recover the state from the final MAC
+         encoded.clear();
+         encoded.seekg(0);
+         c = find_last_block(words_rev, encoded);
+         encoded.clear();
+         encoded.seekg(c.output_offset);
+         encoder.reopen(words_rev, encoded, c.mac_state, c.blocks);
+      }
+      truncate_output(output_file, out, c.output_offset);
+   }
+
+   while (in.good()) // until fail() or eof()
+   {
+      encoder.read(in);
+   }
+
+   // the next append continues from the last block, which isn't written yet
+   checkpoint_origin origin;
+   save_resume_point(name, encoder, output_file, out, origin, nullptr);
+   const mac_words final_mac = encoder.finish();
+   if (not out.flush())
+   {
+      throw error(__FILE__, __LINE__, "cannot write " + output_file);
+   }
+   return final_mac;
+}
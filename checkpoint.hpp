@@ -0,0 +1,28 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Encodes like encode() into the file output_file, and every `interval`
+// bytes of input saves to output_file.checkpoint what is needed to resume:
+// the MAC state and the input and output offsets, once the output is synced,
+// with the size, inode and modification time of input_file and a hash of
+// the output so far. With resume, the encoding continues from the last
+// checkpoint if input_file and the output are still those: out is truncated
+// to its offset and in, which must be seekable, is read from there.
+// The checkpoint is removed when the encoding completes.
+mac_words encode_with_checkpoints(const word_list &words,
+                                  const std::string &input_file, std::istream &in,
+                                  const std::string &output_file, std::ostream &out,
+                                  std::streamsize interval, bool resume);
+// removes the checkpoint of output_file, which is being written again
+void discard_checkpoint(const std::string &output_file);
+
+// Appends the data of in to the encoded file output_file, which out writes
+// without truncating it. Only its last block is encoded again, followed by
+// the new data. The MAC state at the start of the last block is saved in
+// output_file.append for the next time; without it, the state is recovered
+// by reading the encoded file through.
+mac_words encode_append(const word_list &words,
+                        const word_index &words_rev,
+                        std::istream &in,
+                        const std::string &output_file, std::ostream &out);
@@ -0,0 +1,569 @@
+#include "cipher.hpp"
+#include "encodetotext.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+// the AES cipher is built with AES-NI, and runs where the CPU has it
+#define ENCODE_HAS_AES_NI 1
+#include <immintrin.h>
+// only these functions need AES-NI: the others run on any x86
+#define AES_TARGET __attribute__((target("aes")))
+#endif
+
+using namespace std;
+
+namespace {
+
+class xxtea_cipher: public block_cipher
+{
+   uint32 key[4];
+
+public:
+   explicit xxtea_cipher(uint32 const (&key)[4])
+   {
+      copy(key, key + 4, this->key);
+   }
+
+   bool crypt(uint32 *const v, const int n) const override
+   {
+      return btea(v, n, key);
+   }
+};
+
+}
+
+bool aes_available()
+{
+#ifdef ENCODE_HAS_AES_NI
+   return __builtin_cpu_supports("aes");
+#else
+   return false;
+#endif
+}
+
+static void require_aes()
+{
+#ifdef ENCODE_HAS_AES_NI
+   if (not aes_available())
+   {
+      throw error(__FILE__, __LINE__, "this CPU has no AES instructions");
+   }
+#else
+   throw error(__FILE__, __LINE__, "built without AES-NI");
+#endif
+}
+
+#ifdef ENCODE_HAS_AES_NI
+
+namespace {
+
+// the 11 round keys of AES-128
+typedef __m128i aes_schedule[11];
+
+AES_TARGET static __m128i expand_key(__m128i key, __m128i assist)
+{
+   assist = _mm_shuffle_epi32(assist, 0xff);
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   return _mm_xor_si128(key, assist);
+}
+
+AES_TARGET static void schedule(const __m128i key, aes_schedule &keys)
+{
+   keys[0] = key;
+   // the round constant of aeskeygenassist must be a literal
+#define AES_ROUND_KEY(i, rcon) keys[i] = expand_key(keys[i - 1], _mm_aeskeygenassist_si128(keys[i - 1], rcon))
+   AES_ROUND_KEY(1, 0x01);
+   AES_ROUND_KEY(2, 0x02);
+   AES_ROUND_KEY(3, 0x04);
+   AES_ROUND_KEY(4, 0x08);
+   AES_ROUND_KEY(5, 0x10);
+   AES_ROUND_KEY(6, 0x20);
+   AES_ROUND_KEY(7, 0x40);
+   AES_ROUND_KEY(8, 0x80);
+   AES_ROUND_KEY(9, 0x1b);
+   AES_ROUND_KEY(10, 0x36);
+#undef AES_ROUND_KEY
+}
+
+AES_TARGET static __m128i encrypt(const aes_schedule &keys, __m128i x)
+{
+   x = _mm_xor_si128(x, keys[0]);
+   for (int r = 1; r < 10; ++r)
+   {
+      x = _mm_aesenc_si128(x, keys[r]);
+   }
+   return _mm_aesenclast_si128(x, keys[10]);
+}
+
+// 4 independent blocks at once, which hides the latency of aesenc
+AES_TARGET static void encrypt4(const aes_schedule &keys, __m128i (&x)[4])
+{
+   for (auto &b: x) b = _mm_xor_si128(b, keys[0]);
+   for (int r = 1; r < 10; ++r)
+   {
+      for (auto &b: x) b = _mm_aesenc_si128(b, keys[r]);
+   }
+   for (auto &b: x) b = _mm_aesenclast_si128(b, keys[10]);
+}
+
+static __m128i load(const unsigned char *const p)
+{
+   return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+static void store(unsigned char *const p, const __m128i x)
+{
+   _mm_storeu_si128(reinterpret_cast<__m128i*>(p), x);
+}
+
+static void xor_partial(unsigned char *const p, const size_t size, const __m128i mask)
+{
+   unsigned char block[16];
+   store(block, mask);
+   for (size_t i = 0; i < size; ++i) p[i] ^= block[i];
+}
+
+// the integers as their big-endian bytes in place, or back
+static void swap_bytes(uint32 *const v, const int n)
+{
+   for (int i = 0; i < n; ++i) v[i] = htonl(v[i]);
+}
+
+// the doubling in GF(2^128) of SP 800-38B and RFC 5297, on a big-endian block
+static void dbl(unsigned char (&b)[16])
+{
+   const bool carry = b[0] & 0x80;
+   for (int i = 0; i < 15; ++i)
+   {
+      b[i] = static_cast<unsigned char>(b[i] << 1 | b[i + 1] >> 7);
+   }
+   b[15] = static_cast<unsigned char>(b[15] << 1 ^ (carry ? 0x87 : 0));
+}
+
+// xors data with AES of the big-endian counters from counter on, as in SP 800-38A
+AES_TARGET static void ctr_xor(const aes_schedule &keys, const unsigned char *const counter,
+                               unsigned char *const data, const size_t size)
+{
+   uint64_t high, low;
+   memcpy(&high, counter, sizeof high);
+   memcpy(&low, counter + sizeof high, sizeof low);
+   high = be64toh(high);
+   low = be64toh(low);
+   const auto next_counter = [&]
+   {
+      const __m128i block = _mm_set_epi64x(htobe64(low), htobe64(high));
+      if (++low == 0) ++high;
+      return block;
+   };
+
+   size_t offset = 0;
+   for ( ; offset + 64 <= size; offset += 64)
+   {
+      __m128i blocks[4];
+      for (auto &b: blocks) b = next_counter();
+      encrypt4(keys, blocks);
+      for (int i = 0; i < 4; ++i)
+      {
+         unsigned char *const p = data + offset + 16 * i;
+         store(p, _mm_xor_si128(load(p), blocks[i]));
+      }
+   }
+   for ( ; offset < size; offset += 16)
+   {
+      xor_partial(data + offset, std::min<size_t>(16, size - offset), encrypt(keys, next_counter()));
+   }
+}
+
+// AES-CMAC of SP 800-38B over the bytes given to update as they come, under
+// as many keys as lanes at once: their chains are independent, which hides
+// the latency of aesenc. The last block waits for the tag, which xors it
+// with its own subkey.
+template <int lanes>
+class cmac
+{
+   aes_schedule keys[lanes];
+   unsigned char subkeys[lanes][2][16]; // for a whole last block, and for a padded one
+   __m128i chain[lanes];
+   unsigned char last[16];
+   size_t last_size = 0;
+
+   void absorb(const unsigned char *block);
+
+public:
+   // the keys of the lanes are 16 bytes each, one after the other
+   explicit cmac(const unsigned char *key);
+   void update(const unsigned char *data, size_t size);
+   // the tags of the lanes, one after the other
+   void tag(unsigned char (&out)[16 * lanes]) const;
+};
+
+template <int lanes>
+AES_TARGET cmac<lanes>::cmac(const unsigned char *const key)
+{
+   for (int lane = 0; lane < lanes; ++lane)
+   {
+      schedule(load(key + 16 * lane), keys[lane]);
+      chain[lane] = _mm_setzero_si128();
+      unsigned char l[16];
+      store(l, encrypt(keys[lane], _mm_setzero_si128()));
+      dbl(l);
+      memcpy(subkeys[lane][0], l, sizeof l);
+      dbl(l);
+      memcpy(subkeys[lane][1], l, sizeof l);
+   }
+}
+
+template <int lanes>
+AES_TARGET inline void cmac<lanes>::absorb(const unsigned char *const block)
+{
+   const __m128i b = load(block);
+   for (int lane = 0; lane < lanes; ++lane)
+   {
+      chain[lane] = encrypt(keys[lane], _mm_xor_si128(chain[lane], b));
+   }
+}
+
+template <int lanes>
+AES_TARGET void cmac<lanes>::update(const unsigned char *data, size_t size)
+{
+   while (size > 0)
+   {
+      if (last_size == 16)
+      { // it wasn't the last one
+         absorb(last);
+         last_size = 0;
+      }
+      if (last_size == 0)
+      {
+         for ( ; size > 16; data += 16, size -= 16)
+         {
+            absorb(data);
+         }
+      }
+      const size_t n = std::min(16 - last_size, size);
+      memcpy(last + last_size, data, n);
+      last_size += n;
+      data += n;
+      size -= n;
+   }
+}
+
+template <int lanes>
+AES_TARGET void cmac<lanes>::tag(unsigned char (&out)[16 * lanes]) const
+{
+   for (int lane = 0; lane < lanes; ++lane)
+   {
+      unsigned char block[16] = {};
+      memcpy(block, last, last_size);
+      if (last_size < 16) block[last_size] = 0x80;
+      const unsigned char *const subkey = subkeys[lane][last_size == 16 ? 0 : 1];
+      for (int i = 0; i < 16; ++i) block[i] ^= subkey[i];
+      store(out + 16 * lane, encrypt(keys[lane], _mm_xor_si128(chain[lane], load(block))));
+   }
+}
+
+constexpr int siv_integers = 16 / sizeof(uint32);
+
+// AES-SIV of RFC 5297 without associated data, over the big-endian bytes of
+// the integers: the synthetic IV, a CMAC of the plaintext, follows the
+// ciphertext. It is deterministic, so that a block encrypts the same anywhere
+// as the block cache needs, and the IV authenticates the block on decryption.
+class aes_siv_cipher: public block_cipher
+{
+   cmac<1> iv_mac;        // K1, the first half of the key
+   aes_schedule ctr_keys; // K2, the second half
+   unsigned char zero_tag[16]; // the CMAC of the zero block which starts S2V
+
+public:
+   explicit aes_siv_cipher(const unsigned char *key);
+   // S2V after one string of associated data, unless ad is null
+   void s2v(const unsigned char *ad, size_t ad_size, const unsigned char *plain, size_t size,
+            unsigned char (&v)[16]) const;
+   // xors data with the key stream of the counters from v
+   void ctr(const unsigned char (&v)[16], unsigned char *data, size_t size) const;
+
+   bool crypt(uint32 *v, int n) const override;
+   int overhead() const override { return siv_integers; }
+};
+
+AES_TARGET aes_siv_cipher::aes_siv_cipher(const unsigned char *const key)
+   : iv_mac(key)
+{
+   schedule(load(key + 16), ctr_keys);
+   const unsigned char zero[16] = {};
+   cmac<1> mac(iv_mac);
+   mac.update(zero, sizeof zero);
+   mac.tag(zero_tag);
+}
+
+void aes_siv_cipher::s2v(const unsigned char *const ad, const size_t ad_size,
+                         const unsigned char *const plain, const size_t size, unsigned char (&v)[16]) const
+{
+   unsigned char d[16];
+   memcpy(d, zero_tag, sizeof d);
+   if (ad != nullptr)
+   {
+      cmac<1> mac(iv_mac);
+      mac.update(ad, ad_size);
+      unsigned char t[16];
+      mac.tag(t);
+      dbl(d);
+      for (int i = 0; i < 16; ++i) d[i] ^= t[i];
+   }
+
+   cmac<1> mac(iv_mac);
+   if (size >= 16)
+   { // the plaintext with its last 16 bytes xored with d
+      mac.update(plain, size - 16);
+      for (int i = 0; i < 16; ++i) d[i] ^= plain[size - 16 + i];
+   }
+   else
+   { // d doubled, xored with the padded plaintext
+      dbl(d);
+      for (size_t i = 0; i < 16; ++i) d[i] ^= i < size ? plain[i] : i == size ? 0x80 : 0;
+   }
+   mac.update(d, sizeof d);
+   mac.tag(v);
+}
+
+void aes_siv_cipher::ctr(const unsigned char (&v)[16], unsigned char *const data, const size_t size) const
+{
+   unsigned char counter[16];
+   memcpy(counter, v, sizeof counter);
+   counter[8] &= 0x7f; // the bits cleared by RFC 5297 for 64-bit counters
+   counter[12] &= 0x7f;
+   ctr_xor(ctr_keys, counter, data, size);
+}
+
+bool aes_siv_cipher::crypt(uint32 *const v, int n) const
+{
+   const bool decrypt = n < 0;
+   if (decrypt) n = -n - siv_integers;
+   if (n < 2) return false;
+
+   unsigned char *const bytes = reinterpret_cast<unsigned char*>(v);
+   const size_t size = n * sizeof(uint32);
+   unsigned char iv[16];
+   if (not decrypt)
+   {
+      swap_bytes(v, n);
+      s2v(nullptr, 0, bytes, size, iv);
+      ctr(iv, bytes, size);
+      memcpy(bytes + size, iv, sizeof iv);
+      swap_bytes(v, n + siv_integers);
+      return true;
+   }
+
+   swap_bytes(v, n + siv_integers);
+   memcpy(iv, bytes + size, sizeof iv);
+   ctr(iv, bytes, size);
+   unsigned char expected[16];
+   s2v(nullptr, 0, bytes, size, expected);
+   swap_bytes(v, n);
+   unsigned char difference = 0; // all the bytes are compared, in constant time
+   for (int i = 0; i < 16; ++i) difference |= iv[i] ^ expected[i];
+   return difference == 0;
+}
+
+// AES-CMAC over the big-endian bytes of the integers under two keys: the
+// 128 bits of the first tag are the first 4 integers of the MAC, and the
+// first 32 bits of the second tag the last one
+class cmac_authenticator: public stream_authenticator
+{
+   cmac<2> mac;
+
+public:
+   explicit cmac_authenticator(const unsigned char *key)
+      : mac(key)
+   {}
+
+   void update(const uint32 *data, size_t n) override
+   {
+      uint32 chunk[64];
+      while (n > 0)
+      {
+         const size_t m = std::min(n, sizeof chunk / sizeof *chunk);
+         for (size_t i = 0; i < m; ++i) chunk[i] = htonl(data[i]);
+         mac.update(reinterpret_cast<const unsigned char*>(chunk), m * sizeof *chunk);
+         data += m;
+         n -= m;
+      }
+   }
+
+   void digest(uint32 *const result) const override
+   {
+      unsigned char tags[32];
+      mac.tag(tags);
+      for (int i = 0; i < 5; ++i)
+      {
+         uint32 x;
+         memcpy(&x, tags + 4 * i, sizeof x);
+         result[i] = ntohl(x);
+      }
+   }
+
+   unique_ptr<stream_authenticator> clone() const override
+   {
+      return make_unique<cmac_authenticator>(*this);
+   }
+};
+
+}
+
+// The keys of the AES modes, derived from the key of the stream by the KDF
+// in counter mode of SP 800-108 with AES-CMAC, so that no key serves two
+// modes: the block i of out is CMAC(key, [i]32 || label || 0x00 || [bits]32).
+static void derive_key(uint32 const (&key)[4], const char *const label, unsigned char *const out,
+                       const uint32 bits)
+{
+   uint32 master[4];
+   copy(key, key + 4, master);
+   swap_bytes(master, 4);
+   const cmac<1> prf(reinterpret_cast<const unsigned char*>(master));
+   for (uint32 i = 1; i <= bits / 128; ++i)
+   {
+      const uint32 counter = htonl(i), length = htonl(bits);
+      string input(reinterpret_cast<const char*>(&counter), sizeof counter);
+      input.append(label).append(1, '\0').append(reinterpret_cast<const char*>(&length), sizeof length);
+      cmac<1> mac(prf);
+      mac.update(reinterpret_cast<const unsigned char*>(input.data()), input.size());
+      unsigned char block[16];
+      mac.tag(block);
+      memcpy(out + 16 * (i - 1), block, sizeof block);
+   }
+}
+
+static shared_ptr<const block_cipher> make_aes_cipher(uint32 const (&key)[4])
+{
+   unsigned char keys[32];
+   derive_key(key, "encodetotext aes-siv", keys, 256);
+   return make_shared<aes_siv_cipher>(keys);
+}
+
+static unique_ptr<stream_authenticator> make_aes_authenticator(uint32 const (&key)[4])
+{
+   unsigned char mac_keys[32];
+   derive_key(key, "encodetotext aes-cmac", mac_keys, 256);
+   return make_unique<cmac_authenticator>(mac_keys);
+}
+
+AES_TARGET void aes_encrypt_block(const unsigned char *const key, const unsigned char *const in,
+                                  unsigned char *const out)
+{
+   require_aes();
+   aes_schedule keys;
+   schedule(load(key), keys);
+   store(out, encrypt(keys, load(in)));
+}
+
+AES_TARGET void aes_ctr(const unsigned char *const key, const unsigned char *const counter,
+                        unsigned char *const data, const size_t size)
+{
+   require_aes();
+   aes_schedule keys;
+   schedule(load(key), keys);
+   ctr_xor(keys, counter, data, size);
+}
+
+void aes_cmac(const unsigned char *const key, const unsigned char *const data, const size_t size,
+              unsigned char *const tag)
+{
+   require_aes();
+   cmac<1> mac(key);
+   mac.update(data, size);
+   unsigned char t[16];
+   mac.tag(t);
+   memcpy(tag, t, sizeof t);
+}
+
+void aes_siv_encrypt(const unsigned char *const key, const unsigned char *const ad, const size_t ad_size,
+                     const unsigned char *const plain, const size_t size, unsigned char *const out)
+{
+   require_aes();
+   const aes_siv_cipher siv(key);
+   unsigned char v[16];
+   siv.s2v(ad, ad_size, plain, size, v);
+   memcpy(out, v, sizeof v);
+   copy(plain, plain + size, out + sizeof v);
+   siv.ctr(v, out + sizeof v, size);
+}
+
+#else
+
+// without AES-NI, require_aes throws before any of these would be needed
+
+static shared_ptr<const block_cipher> make_aes_cipher(uint32 const (&)[4])
+{
+   return nullptr;
+}
+
+static unique_ptr<stream_authenticator> make_aes_authenticator(uint32 const (&)[4])
+{
+   return nullptr;
+}
+
+void aes_encrypt_block(const unsigned char*, const unsigned char*, unsigned char*)
+{
+   require_aes();
+}
+
+void aes_ctr(const unsigned char*, const unsigned char*, unsigned char*, size_t)
+{
+   require_aes();
+}
+
+void aes_cmac(const unsigned char*, const unsigned char*, size_t, unsigned char*)
+{
+   require_aes();
+}
+
+void aes_siv_encrypt(const unsigned char*, const unsigned char*, size_t, const unsigned char*, size_t, unsigned char*)
+{
+   require_aes();
+}
+
+#endif
+
+shared_ptr<const block_cipher> make_cipher(const cipher_id id, uint32 const (&key)[4])
+{
+   if (id == cipher_id::xxtea)
+   {
+      return make_shared<xxtea_cipher>(key);
+   }
+   require_aes();
+   return make_aes_cipher(key);
+}
+
+unique_ptr<stream_authenticator> make_authenticator(const cipher_id id, uint32 const (&key)[4])
+{
+   if (id == cipher_id::xxtea)
+   {
+      return nullptr;
+   }
+   require_aes();
+   return make_aes_authenticator(key);
+}
+
+const char *cipher_name(const cipher_id id)
+{
+   return id == cipher_id::aes ? "aes" : "xxtea";
+}
+
+bool find_cipher(const string &name, cipher_id &id)
+{
+   for (const cipher_id c: {cipher_id::xxtea, cipher_id::aes})
+   {
+      if (name == cipher_name(c))
+      {
+         id = c;
+         return true;
+      }
+   }
+   return false;
+}
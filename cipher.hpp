@@ -0,0 +1,60 @@
+#pragma once
+
+#include "btea.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// the block ciphers of an encoding: btea by default, recorded in the stream otherwise
+enum class cipher_id { xxtea, aes };
+
+// A block cipher with its key. Like btea, it encrypts n native integers in
+// place as a whole, decrypts them for a negative n, and fails below 2.
+// A cipher may write integers after the data when it encrypts, as many as
+// its overhead: a negative n counts them, and the decryption fails when
+// they don't authenticate the data.
+class block_cipher
+{
+public:
+   virtual ~block_cipher() = default;
+   virtual bool crypt(uint32 *v, int n) const = 0;
+   virtual int overhead() const { return 0; }
+};
+
+// The MAC of the encrypted integers of a stream, for a cipher which brings
+// its own instead of the CBC-MAC of CbcMac over btea.
+class stream_authenticator
+{
+public:
+   virtual ~stream_authenticator() = default;
+   // adds n integers: the MAC doesn't depend on how they are split
+   virtual void update(const uint32 *data, std::size_t n) = 0;
+   // the MAC of the integers so far, as CbcMac::stateSize integers
+   virtual void digest(uint32 *mac) const = 0;
+   virtual std::unique_ptr<stream_authenticator> clone() const = 0;
+};
+
+// whether AES can run here: built for x86, on a CPU with AES-NI
+bool aes_available();
+// btea with key, or AES-128-SIV with AES-NI, which throws unless aes_available()
+std::shared_ptr<const block_cipher> make_cipher(cipher_id id, uint32 const (&key)[4]);
+// for AES, two AES-CMACs under keys of their own, which fill the 160 bits of
+// the MAC with 128 and 32 bits of their tags; null for btea whose MAC is
+// CbcMac itself
+std::unique_ptr<stream_authenticator> make_authenticator(cipher_id id, uint32 const (&key)[4]);
+// the name of a cipher, as given to --cipher and written in the stream
+const char *cipher_name(cipher_id id);
+bool find_cipher(const std::string &name, cipher_id &id);
+
+// The AES modes behind the cipher, over bytes, for their known-answer tests.
+// The keys are 16 bytes, 32 for SIV, and all of them throw unless aes_available().
+void aes_encrypt_block(const unsigned char *key, const unsigned char *in, unsigned char *out);
+// xors data with the key stream of SP 800-38A from counter, a big-endian block
+void aes_ctr(const unsigned char *key, const unsigned char *counter, unsigned char *data, std::size_t size);
+// the tag of SP 800-38B, 16 bytes
+void aes_cmac(const unsigned char *key, const unsigned char *data, std::size_t size, unsigned char *tag);
+// the synthetic IV then the ciphertext of RFC 5297, size + 16 bytes, with
+// one string of associated data or none when ad is null
+void aes_siv_encrypt(const unsigned char *key, const unsigned char *ad, std::size_t ad_size,
+                     const unsigned char *plain, std::size_t size, unsigned char *out);
@@ -1,6 +1,11 @@
+#pragma once
+
 #include "btea.h"
+#include "cipher.hpp"
 
 #include <algorithm>
+#include <cassert>
+#include <cstddef>
 
 namespace detail {
 
@@ -20,7 +25,10 @@ class CbcMac
 public:
 	static constexpr int stateSize = 5; // 5*32 = 160 bits, like SHA1
 
-	CbcMac(uint32 const (&key)[4])
+	// the CBC-MAC of btea, or the authenticator of another cipher, which
+	// can't go back: restore, restoreFromDigest and revert are for btea only
+	CbcMac(uint32 const (&key)[4], cipher_id id = cipher_id::xxtea)
+		: authenticator(make_authenticator(id, key))
 	{
 		for (int i = 0; i < 4; i++)
 		{
@@ -34,16 +42,84 @@ public:
 		detail::Xor(k2, opad);
 	}
 
+	CbcMac(const CbcMac &other)
+	{
+		*this = other;
+	}
+
+	CbcMac(CbcMac&&) = default;
+
+	CbcMac& operator= (const CbcMac &other)
+	{ // the authenticator is cloned with its state
+		std::copy(&other.k1[0], &other.k1[4], k1);
+		std::copy(&other.k2[0], &other.k2[4], k2);
+		std::copy(&other.state[0], &other.state[stateSize], state);
+		authenticator = other.authenticator ? other.authenticator->clone() : nullptr;
+		return *this;
+	}
+
+	CbcMac& operator= (CbcMac&&) = default;
+
 	void update(uint32 const (&data)[stateSize])
 	{
+		assert(not authenticator);
 		detail::Xor(state, data);
 		btea(state, stateSize, k1);
 	}
 
+	void updateBuffer(const uint32 *data, std::ptrdiff_t size)
+	{ // the last stateSize integers are padded with zeros for btea, so that
+	  // only the last buffer may end elsewhere than on their boundary
+		if (authenticator)
+		{
+			authenticator->update(data, size);
+			return;
+		}
+		std::ptrdiff_t i = 0;
+		for ( ; i < size - stateSize; i += stateSize)
+		{
+			update(reinterpret_cast<uint32 const (&)[stateSize]>(data[i]));
+		}
+		uint32 last[stateSize] = {};
+		std::copy(data + i, data + size, last);
+		update(last);
+	}
+
+	uint32 const (& currentState() const)[stateSize]
+	{ // the chaining state, to continue the MAC later with restore
+		assert(not authenticator);
+		return state;
+	}
+
+	void restore(uint32 const (&saved)[stateSize])
+	{
+		assert(not authenticator);
+		std::copy(&saved[0], &saved[stateSize], state);
+	}
+
+	void restoreFromDigest(uint32 const (&digest)[stateSize])
+	{ // the cipher is a permutation: the digest gives back the state
+		assert(not authenticator);
+		std::copy(&digest[0], &digest[stateSize], state);
+		btea(state, -stateSize, k2);
+	}
+
+	void revert(uint32 const (&data)[stateSize])
+	{ // the state before update(data)
+		assert(not authenticator);
+		btea(state, -stateSize, k1);
+		detail::Xor(state, data);
+	}
+
 	uint32 const (& digest() const)[stateSize]
 	{ // computes the digest with a copy of the state so that
 	  // you may still call update next
 
+		if (authenticator)
+		{
+			authenticator->digest(state2);
+			return state2;
+		}
 		std::copy(&state[0], &state[stateSize], state2);
 		btea(state2, stateSize, k2);
 		return state2;
@@ -52,6 +128,7 @@ public:
 private:
 	uint32 k1[4];
 	uint32 k2[4];
+	std::unique_ptr<stream_authenticator> authenticator;
 	uint32 state[stateSize] = {};
 	mutable uint32 state2[stateSize];
 };
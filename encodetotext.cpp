@@ -1,5 +1,6 @@
 #include "encodetotext.hpp"
 #include "crypto.hpp"
+#include "probes.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -42,70 +43,238 @@ static uint16_t readu16(const char *buffer)
    return ntohs(i);
 }
 
-static void writeu16(char *buffer, const uint16_t value)
+static uint32 static_key[4] = {3449741923u, 1428823133u, 719882406u, 2957402939u};
+// btea with static_key, made again when the key is loaded instead of at each block
+static shared_ptr<const block_cipher> static_cipher = make_cipher(cipher_id::xxtea, static_key);
+
+// reads a key from in, which is open
+static void read_key(istream &in, cipher_key &key)
 {
-   const uint16_t i = htons(value);
-   memcpy(buffer, &i, sizeof i);
-}
+   char buffer[sizeof key];
+   in.read(buffer, sizeof key);
+   if (in.gcount() != sizeof key)
+   {
+      throw error(__FILE__, __LINE__, "invalid key");
+   }
 
-static uint32 static_key[4] = {3449741923u, 1428823133u, 719882406u, 2957402939u};
+   for (size_t i = 0; i < sizeof key / sizeof *key; ++i)
+   {
+      key[i] = readu32(buffer + i * sizeof *key);
+   }
+}
 
 void load_static_key()
 {
    ifstream in("encode.key", ios::binary);
    if (in)
    {
-      char buffer[sizeof static_key];
-      in.read(buffer, sizeof static_key);
-      if (in.gcount() != sizeof static_key)
-      {
-         throw error(__FILE__, __LINE__, "invalid key");
-      }
-
-      for (size_t i = 0; i < sizeof static_key / sizeof *static_key; ++i)
-      {
-         static_key[i] = readu32(buffer + i * sizeof *static_key);
-      }
-      clog << "new key loaded." << endl;
+      read_key(in, static_key);
+      static_cipher = make_cipher(cipher_id::xxtea, static_key);
+      clog << "new key loaded.\n";
    }
    else
    {
-      clog << "using the default key." << endl;
+      clog << "using the default key.\n";
    }
 }
 
-constexpr streamsize BUFFER_SIZE = CbcMac::stateSize * sizeof(uint32) << 10; // ensure multiple of sizeof(uint32) and CbcMac::stateSize
-constexpr streamsize NATIVE_BUFFER_SIZE = BUFFER_SIZE / sizeof(uint32);
+void load_key(const string &file, cipher_key &key)
+{
+   ifstream in(file, ios::binary);
+   if (not in)
+   {
+      throw error(__FILE__, __LINE__, "cannot open the key " + file);
+   }
+   read_key(in, key);
+}
 
-static void mac_process_buffer(uint32 *const native_buffer, const streamsize size, CbcMac &mac)
+namespace {
+
+struct ring_key
 {
-   streamsize i = 0;
-   for (i = 0; i < size - CbcMac::stateSize; i += CbcMac::stateSize)
+   cipher_key key;
+   key_id id;
+};
+
+}
+
+static vector<ring_key> keyring;
+
+void load_keyring(const string &file)
+{
+   ifstream in(file);
+   if (not in) return; // the loaded key only
+   string line;
+   while (getline(in, line))
    {
-      mac.update(reinterpret_cast<uint32 const (&)[CbcMac::stateSize]>(native_buffer[i]));
+      if (line.empty() or line[0] == '#') continue;
+      ring_key k;
+      try
+      {
+         load_key(line, k.key);
+      }
+      catch (const exception &exc)
+      { // the other keys are still usable
+         cerr << "warning: the key " << line << " of " << file << " is skipped: " << exc.what() << '\n';
+         continue;
+      }
+      k.id = key_fingerprint(k.key);
+      keyring.push_back(k);
    }
+   clog << "keyring loaded, " << keyring.size() << (keyring.size() == 1 ? " key.\n" : " keys.\n");
+}
 
-   // update last (potentially partial) block
-   uint32 mac_buffer[CbcMac::stateSize] = {};
-   for (auto p = mac_buffer; i < size; ++i)
+// the key of a stream by its id, without trying the keys on its data
+static const cipher_key &find_key(const key_id &id)
+{
+   if (key_fingerprint(static_key) == id) return static_key;
+   for (const ring_key &k: keyring)
    {
-      *p++ = native_buffer[i];
+      if (k.id == id) return k.key;
    }
-   mac.update(mac_buffer);
+   throw error(__FILE__, __LINE__, "the key of the stream is neither the loaded key nor in the keyring");
+}
+
+static void mac_process_buffer(const uint32 *const native_buffer, const streamsize size, CbcMac &mac)
+{
+   ENCODE_PROBE1(mac_update, size);
+   mac.updateBuffer(native_buffer, size);
 }
 
-static void mac_output(const vector<small_string> &words, const CbcMac &mac, ostream &out)
+static_assert(tuple_size<mac_words>::value == CbcMac::stateSize * sizeof(uint32) / sizeof(uint16_t),
+   "mac_words doesn't hold a CbcMac digest");
+
+static mac_words mac_to_words(const CbcMac &mac)
 {
+   mac_words result;
+   size_t e = 0;
    for (uint32 const x: mac.digest())
    {
       char temp[sizeof x];
       writeu32(temp, x);
-      out << words[readu16(temp)] << ' ' << words[readu16(temp + sizeof(uint16_t))] << ' ';
+      result[e++] = readu16(temp);
+      result[e++] = readu16(temp + sizeof(uint16_t));
+   }
+   return result;
+}
+
+key_id key_fingerprint(const cipher_key &key)
+{
+   // like the MAC of a stream, it tells nothing of the key
+   CbcMac mac(key);
+   constexpr uint32 constant[CbcMac::stateSize] = {0x6b65792d, 0x69640000}; // "key-id"
+   mac.update(constant);
+   const mac_words digest = mac_to_words(mac);
+   return {digest[0], digest[1]};
+}
+
+// the 8 bytes of a word in the fixed width format: padded with blanks
+static uint64_t fixed_field(const small_string &word)
+{
+   const size_t length = word.length();
+   return word.value | (length == small_string::size() ? 0 : 0x2020202020202020u >> 8 * length);
+}
+
+static mac_words mac_output(const word_list &words, const CbcMac &mac, ostream &out,
+                            const bool fixed = false)
+{
+   const mac_words result = mac_to_words(mac);
+   for (const uint16_t w: result)
+   {
+      if (fixed)
+      {
+         const uint64_t field = htobe64(fixed_field(words[w]));
+         out.write(reinterpret_cast<const char*>(&field), sizeof field);
+         out << ' ';
+      }
+      else
+      {
+         out << words[w] << ' ';
+      }
+   }
+   return result;
+}
+
+static void raw_mac_output(const mac_words &mac, ostream &out)
+{
+   for (const uint16_t w: mac)
+   {
+      const uint16_t big_endian = htons(w);
+      out.write(reinterpret_cast<const char*>(&big_endian), sizeof big_endian);
    }
 }
 
-static void pad_and_crypt(char *const buffer, streamsize &bytes_read, CbcMac &mac)
+// the words of the native integers from begin to end of a block, written
+// from p on, which returns the end: all the bytes of each word are copied,
+// and a fixed width word takes them all
+template <bool fixed>
+static char *render_text(const word_list &words, const uint32 *const native_buffer,
+                         const streamsize begin, const streamsize end, char *p)
 {
+   constexpr size_t word_size = small_string::size();
+   for (streamsize i = begin; i < end; ++i)
+   { // 4 integers per line: the new line is cosmetic
+      for (const uint16_t w: {uint16_t(native_buffer[i] >> 16), uint16_t(native_buffer[i])})
+      {
+         if (fixed)
+         {
+            const uint64_t field = htobe64(fixed_field(words[w]));
+            memcpy(p, &field, word_size);
+            p += word_size;
+         }
+         else
+         {
+            char word[word_size];
+            words[w].copy_to(word);
+            memcpy(p, word, word_size);
+            p += words[w].length();
+         }
+         *p++ = ' ';
+      }
+      if (i % 4 == 3) p[-1] = '\n';
+   }
+   return p;
+}
+
+size_t render_block(const word_list &words, const uint32 *const natives, const streamsize size, char *const text)
+{
+   return render_text<false>(words, natives, 0, size, text) - text;
+}
+
+// the words of the native integers, rendered a chunk at a time: the chunk is
+// still in the L1 cache when its words are written, in one piece of text
+static void render_words(const word_list &words, const uint32 *const native_buffer,
+                         const streamsize size, CbcMac *const mac, ostream &out,
+                         const bool fixed = false)
+{
+   constexpr streamsize chunk = 64 * CbcMac::stateSize; // a whole number of MAC updates
+   constexpr size_t word_size = small_string::size();
+   // each word takes its length and a separator, but all its bytes are copied
+   char text[chunk * 2 * (word_size + 1) + word_size];
+   for (streamsize begin = 0; begin < size; begin += chunk)
+   {
+      const streamsize end = std::min(size, begin + chunk);
+      if (mac != nullptr)
+      {
+         mac_process_buffer(native_buffer + begin, end - begin, *mac);
+      }
+
+      const streamsize text_size = (fixed ? render_text<true>(words, native_buffer, begin, end, text)
+                                          : render_text<false>(words, native_buffer, begin, end, text)) - text;
+      ENCODE_PROBE1(render_flush, text_size);
+      out.write(text, text_size);
+   }
+}
+
+streamsize pad_and_crypt(uint32 *const native_buffer, streamsize &bytes_read)
+{
+   return pad_and_crypt(native_buffer, bytes_read, *static_cipher);
+}
+
+streamsize pad_and_crypt(uint32 *const native_buffer, streamsize &bytes_read, const block_cipher &cipher)
+{
+   ENCODE_PROBE1(crypt_start, bytes_read);
+   char *const buffer = reinterpret_cast<char*>(native_buffer);
    // pad if necessary
    if (bytes_read < BUFFER_SIZE)
    {
@@ -125,83 +294,299 @@ static void pad_and_crypt(char *const buffer, streamsize &bytes_read, CbcMac &ma
 
    // convert to native integers
    const streamsize data_size = bytes_read / sizeof(uint32);
-   uint32 native_buffer[NATIVE_BUFFER_SIZE];
    for (streamsize i = 0; i < data_size; ++i) {
-      native_buffer[i] = readu32(buffer + sizeof(uint32) * i);
+      native_buffer[i] = ntohl(native_buffer[i]);
    }
 
-   // crypt
-   BOOL btea_result = btea(native_buffer, data_size, static_key);
-   if (not btea_result)
+   // crypt, with what the cipher adds after the data in the slack of the block
+   assert(cipher.overhead() * sizeof(uint32) <= block_buffer::slack);
+   if (not cipher.crypt(native_buffer, data_size))
    {
       ostringstream msg;
-      msg << "btea failed with size " << data_size;
+      msg << "the cipher failed with size " << data_size;
       throw error(__FILE__, __LINE__, msg.str());
    }
+   ENCODE_PROBE1(crypt_end, data_size);
+   return data_size + cipher.overhead();
+}
 
-   // update mac with encrypted data
-   mac_process_buffer(native_buffer, data_size, mac);
+stream_mac::stream_mac()
+   : mac(static_key)
+{}
 
-   // convert back to bytes
-   for (streamsize i = 0; i < data_size; ++i) {
-      writeu32(buffer + sizeof(uint32) * i, native_buffer[i]);
-   }
+void stream_mac::update(const uint32 *const natives, const streamsize size)
+{
+   mac_process_buffer(natives, size, mac);
 }
 
-void encode(const vector<small_string> &words, istream &in, ostream &out)
+mac_words stream_mac::digest() const
+{
+   return mac_to_words(mac);
+}
+
+void initial_mac_state(uint32 (&mac_state)[CbcMac::stateSize])
+{
+   const CbcMac mac(static_key);
+   copy(begin(mac.currentState()), end(mac.currentState()), mac_state);
+}
+
+mac_words authenticate(const uint32 *data, const streamsize size)
 {
    CbcMac mac(static_key);
-   char buffer[BUFFER_SIZE];
+   mac_process_buffer(data, size, mac);
+   return mac_to_words(mac);
+}
+
+Encoder::Encoder(const word_list &words, ostream &out, const encoded_format format)
+   : words(words), out(out), mac(static_key), format(format), key(&static_key),
+     data_cipher(static_cipher)
+{}
+
+void Encoder::write_initial_mac()
+{
+   if (format == encoded_format::raw)
+   {
+      out.write(raw_magic, sizeof raw_magic);
+      raw_mac_output(mac_to_words(mac), out);
+      return;
+   }
+   if (write_key_id)
+   {
+      const key_id id = key_fingerprint(*key);
+      out << key_id_mark << ' ' << words[id[0]] << ' ' << words[id[1]] << ' ';
+   }
+   if (cipher != cipher_id::xxtea)
+   {
+      out << cipher_mark << cipher_name(cipher) << ' ';
+   }
+   const bool fixed = format == encoded_format::fixed;
+   mac_output(words, mac, out, fixed);
+   // the new line is cosmetic, the comma is meaningful in the format, and
+   // a semicolon tells the fixed width words
+   out << (fixed ? ";\n" : ",\n");
+}
+
+void Encoder::use_key(const cipher_key &key)
+{
+   if (nb_blocks != 0 or size != 0)
+   {
+      throw error(__FILE__, __LINE__, "the key must be set before the data");
+   }
+   mac = CbcMac(key, cipher);
+   data_cipher = make_cipher(cipher, key);
+   this->key = &key;
+}
+
+void Encoder::use_cipher(const cipher_id id)
+{
+   if (nb_blocks != 0 or size != 0)
+   {
+      throw error(__FILE__, __LINE__, "the cipher must be set before the data");
+   }
+   if (format != encoded_format::words and id != cipher_id::xxtea)
+   {
+      throw error(__FILE__, __LINE__, "only the words format records the cipher");
+   }
+   cipher = id;
+   mac = CbcMac(*key, cipher);
+   data_cipher = make_cipher(cipher, *key);
+}
 
-   // process the first block separately for the first CbcMac
-   in.read(buffer, BUFFER_SIZE); // always read BUFFER_SIZE until EOF
-   streamsize bytes_read = in.gcount();
-   pad_and_crypt(buffer, bytes_read, mac); // buffer, bytes_read and mac are updated
+void Encoder::use_key_id()
+{
+   if (nb_blocks != 0 or size != 0)
+   {
+      throw error(__FILE__, __LINE__, "the id of the key must be set before the data");
+   }
+   if (format != encoded_format::words)
+   {
+      throw error(__FILE__, __LINE__, "only the words format records the id of the key");
+   }
+   write_key_id = true;
+}
 
-   mac_output(words, mac, out);
-   out << ",\n"; // the new line is cosmetic, the comma is meaningful in the format
+void Encoder::resume(uint32 const (&mac_state)[CbcMac::stateSize], const streamsize blocks)
+{
+   mac.restore(mac_state);
+   nb_blocks = blocks;
+   size = 0;
+}
 
-   for ( ; ; )
+streamsize Encoder::read(istream &in)
+{
+   in.read(bytes() + size, BUFFER_SIZE - size); // always read BUFFER_SIZE until EOF
+   const streamsize bytes_read = in.gcount();
+   size += bytes_read;
+   if (size == BUFFER_SIZE)
    {
-      const streamsize data_size = bytes_read / sizeof(uint16_t);
-      for (streamsize i = 0; i < data_size; ++i) {
-         out << words[readu16(buffer + sizeof(uint16_t) * i)]
-             << (i % 8 != 7 ? ' ' : '\n'); // the new line is cosmetic
+      flush_block();
+   }
+   return bytes_read;
+}
+
+void Encoder::flush_block()
+{
+   ENCODE_PROBE2(block_read, nb_blocks, size);
+   const bool fixed = format == encoded_format::fixed;
+   if (format == encoded_format::raw)
+   { // the integers are written back big-endian instead of as words
+      const streamsize data_size = pad_and_crypt(buffer, size, *data_cipher);
+      mac_process_buffer(buffer, data_size, mac);
+      if (nb_blocks == 0)
+      {
+         write_initial_mac();
+      }
+      for (streamsize i = 0; i < data_size; ++i)
+      {
+         buffer[i] = htonl(buffer[i]);
+      }
+      out.write(bytes(), data_size * sizeof(uint32));
+      ++nb_blocks;
+      size = 0;
+      return;
+   }
+
+   if (cache != nullptr and size == BUFFER_SIZE)
+   { // the padded last block is never cached
+      bool hit;
+      block_cache::entry &cached = cache->lookup(bytes(), size, hit);
+      if (not hit)
+      {
+         const streamsize data_size = pad_and_crypt(buffer, size, *data_cipher);
+         cached.natives.assign(buffer, buffer + data_size);
+         ostringstream text;
+         render_words(words, buffer, data_size, nullptr, text, fixed);
+         cached.value = text.str();
+      }
+
+      mac_process_buffer(cached.natives.data(), cached.natives.size(), mac);
+      if (nb_blocks == 0)
+      { // the first block gives the first CbcMac, before its words
+         write_initial_mac();
       }
+      out.write(cached.value.data(), cached.value.size());
+      ++nb_blocks;
+      size = 0;
+      return;
+   }
+
+   const streamsize data_size = pad_and_crypt(buffer, size, *data_cipher); // buffer and size are updated
+
+   if (nb_blocks == 0)
+   { // the first block gives the first CbcMac, before its words
+      mac_process_buffer(buffer, data_size, mac);
+      write_initial_mac();
+      render_words(words, buffer, data_size, nullptr, out, fixed);
+   }
+   else
+   { // the MAC is updated as the words are written
+      render_words(words, buffer, data_size, &mac, out, fixed);
+   }
+   ++nb_blocks;
+   size = 0;
+}
 
+void Encoder::write(const char *data, streamsize data_size)
+{
+   while (data_size > 0)
+   {
+      const streamsize n = std::min(data_size, BUFFER_SIZE - size);
+      memcpy(bytes() + size, data, n);
+      size += n;
+      data += n;
+      data_size -= n;
+      if (size == BUFFER_SIZE)
+      {
+         flush_block();
+      }
+   }
+}
 
-      if (not in.good()) break; // break if fail() or eof()
+void Encoder::write_encrypted(const uint32 *const natives, const char *const text, const size_t text_size)
+{
+   if (size != 0 or format != encoded_format::words)
+   {
+      throw error(__FILE__, __LINE__, "an encrypted block must start on a block boundary of words");
+   }
+   mac_process_buffer(natives, NATIVE_BUFFER_SIZE, mac);
+   if (nb_blocks == 0)
+   { // the first block gives the first CbcMac, before its words
+      write_initial_mac();
+   }
+   out.write(text, text_size);
+   ++nb_blocks;
+}
 
-      in.read(buffer, BUFFER_SIZE); // always read BUFFER_SIZE until EOF
-      bytes_read = in.gcount();
-      pad_and_crypt(buffer, bytes_read, mac); // buffer, bytes_read and mac are updated
+mac_words Encoder::finish()
+{
+   flush_block(); // even empty, the last block is padded
+   if (format == encoded_format::raw)
+   {
+      const mac_words final_mac = mac_to_words(mac);
+      raw_mac_output(final_mac, out);
+      return final_mac;
    }
 
    // write the CbcMac as words
    out << ".\n"; // the new line is cosmetic, the point is meaningful in the format
-   mac_output(words, mac, out);
+   const mac_words final_mac = mac_output(words, mac, out, format == encoded_format::fixed);
    out << '\n'; // end the file with a new line
+   return final_mac;
+}
+
+mac_words encode(const word_list &words, istream &in, ostream &out, block_cache *const cache,
+                 const cipher_id cipher, const bool with_key_id)
+{
+   Encoder encoder(words, out);
+   encoder.use_cipher(cipher);
+   if (with_key_id)
+   {
+      encoder.use_key_id();
+   }
+   if (cache != nullptr)
+   {
+      encoder.use_cache(*cache);
+   }
+   while (in.good()) // until fail() or eof()
+   {
+      encoder.read(in);
+   }
+   return encoder.finish();
 }
 
+mac_words encode_raw(istream &in, ostream &out)
+{
+   static const word_list no_words;
+   Encoder encoder(no_words, out, encoded_format::raw);
+   while (in.good())
+   {
+      encoder.read(in);
+   }
+   return encoder.finish();
+}
+
+// the native integers of a block as they are decoded, then its bytes in place
 class Buffers
 {
-   char data[2][BUFFER_SIZE] = {};
+   block_buffer data[2]; // only the bytes up to the sizes are used
    streamsize sizes[2] = {};
    bool current = false;
 public:
    void flip() { current = not current; }
-   char *first() { return data[current]; }
-   char *second() { return data[not current]; }
+   uint32 *first() { return data[current].data(); }
+   const char *second() const { return reinterpret_cast<const char*>(data[not current].data()); }
    streamsize& firstSize() { return sizes[current]; }
    streamsize& secondSize() { return sizes[not current]; }
 };
 
-static char *bufferise_data(Buffers &buffers, const uint16_t data)
+// each pair of words makes a native integer, up to a whole encrypted block
+static uint32 *bufferise_data(Buffers &buffers, const uint16_t data, const streamsize block_size)
 {
    streamsize& data_size = buffers.firstSize();
-   writeu16(buffers.first() + data_size, data);
+   uint32 &native = buffers.first()[data_size / sizeof(uint32)];
+   native = data_size % sizeof(uint32) == 0 ? uint32(data) << 16 : native | data;
    data_size += sizeof data;
-   if (data_size == BUFFER_SIZE)
+   if (data_size == block_size)
    {
       return buffers.first(); // a buffer full of data is available
    }
@@ -211,6 +596,31 @@ static char *bufferise_data(Buffers &buffers, const uint16_t data)
    }
 }
 
+// returns the size of the padding at the end of the decrypted last block, or throws if it is invalid
+static streamsize check_padding(const char *const buffer, const streamsize data_size)
+{
+   const streamsize padding_size = to_byte(buffer[data_size - 1]);
+
+   // check that padding is correct
+   if (padding_size > data_size)
+      goto invalid_padding;
+   if (data_size > 8 and (padding_size < 1 or padding_size > 4)
+      or (padding_size < 1 or padding_size > 8))
+      goto invalid_padding;
+   for (auto i = data_size - 2; i >= data_size - padding_size; --i)
+      if (to_byte(buffer[i]) != padding_size)
+         goto invalid_padding;
+   return padding_size;
+
+invalid_padding:
+   ostringstream msg;
+   const streamsize begin = std::max<streamsize>(0, data_size - padding_size), end = data_size;
+   msg << "invalid padding[" << begin << ';' << end << "):" << hex;
+   for (auto i = begin; i < end; ++i)
+      msg << ' ' << to_byte(buffer[i]);
+   throw error(__FILE__, __LINE__, msg.str());
+}
+
 static void remove_padding(Buffers &buffers, ostream &out)
 {
    const char *const prev_buffer = buffers.second();
@@ -224,23 +634,12 @@ static void remove_padding(Buffers &buffers, ostream &out)
       }
       // and save the current buffer
       buffers.flip(); // invalidates prev_buffer and prev_data_size
-      return;
    }
    else
    { // eof has been hit
       if (prev_data_size > 0)
       {
-         const streamsize padding_size = to_byte(prev_buffer[prev_data_size - 1]);
-
-         // check that padding is correct
-         if (padding_size > prev_data_size)
-            goto invalid_padding;
-         if (prev_data_size > 8 and (padding_size < 1 or padding_size > 4)
-            or (padding_size < 1 or padding_size > 8))
-            goto invalid_padding;
-         for (auto i = prev_data_size - 2; i >= prev_data_size - padding_size; --i)
-            if (to_byte(prev_buffer[i]) != padding_size)
-               goto invalid_padding;
+         const streamsize padding_size = check_padding(prev_buffer, prev_data_size);
 
          // output except the padding
          out.write(prev_buffer, prev_data_size - padding_size);
@@ -248,31 +647,19 @@ static void remove_padding(Buffers &buffers, ostream &out)
          prev_data_size = 0;
       }
       // else out will be empty because no data
-      return;
    }
-
-invalid_padding:
-   ostringstream msg;
-   const streamsize padding_size = to_byte(prev_buffer[prev_data_size - 1]);
-   const streamsize begin = std::max<streamsize>(0, prev_data_size - padding_size), end = prev_data_size;
-   msg << "invalid padding[" << begin << ';' << end << "):" << hex;
-   for (auto i = begin; i < end; ++i)
-      msg << ' ' << to_byte(prev_buffer[i]);
-   throw error(__FILE__, __LINE__, msg.str());
 }
 
-void check_mac(CbcMac const& mac, const char*const kind, uint16_t (&expectedMac)[sizeof mac.digest() / (sizeof(uint16_t))])
+static void check_mac(CbcMac const& mac, const char*const kind, const mac_words &expectedMac)
 {
+   const mac_words actual = mac_to_words(mac);
    bool ok = true;
-   size_t e = 0;
    // check all words in order to avoid timing attacks
-   for (uint32 const x: mac.digest())
+   for (size_t e = 0; e < actual.size(); ++e)
    {
-      char temp[sizeof x];
-      writeu32(temp, x);
-      ok &= readu16(temp) == expectedMac[e++];
-      ok &= readu16(temp + sizeof(uint16_t)) == expectedMac[e++];
+      ok &= actual[e] == expectedMac[e];
    }
+   ENCODE_PROBE2(check_mac, kind, ok);
 
    if (not ok)
    {
@@ -282,171 +669,678 @@ void check_mac(CbcMac const& mac, const char*const kind, uint16_t (&expectedMac)
    }
 }
 
-void decode(const unordered_map<small_string, uint16_t> &words_rev, istream &in, ostream &out)
+namespace {
+
+// what precedes the initial MAC
+struct stream_header
 {
-   CbcMac mac(static_key);
-   Buffers buffers;
+   bool has_key_id = false;
+   key_id key = {};
+   cipher_id cipher = cipher_id::xxtea;
+};
+
+// The words of an encoded stream in the text format, as decode_source reads
+// them: a MAC, the data until its end, then the other MAC.
+class text_source
+{
+   const word_index &words_rev;
+   istream &in;
    small_string word;
-   constexpr size_t macDigestSizeInWords = sizeof mac.digest() / (sizeof(uint16_t));
-   uint16_t expectedMac[macDigestSizeInWords] = {};
-   size_t macPos;
-   for (macPos = 0; macPos < macDigestSizeInWords; ++macPos)
+   bool data = false; // the initial MAC is read
+
+public:
+   text_source(const word_index &words_rev, istream &in)
+      : words_rev(words_rev), in(in)
+   {}
+
+   // the id of the key and the cipher, if they are named before the initial MAC
+   stream_header header()
    {
-      if (in >> word)
+      stream_header h;
+      if ((in >> ws).peek() == key_id_mark)
       {
-         const auto words_rev_iter = words_rev.find(word);
-         if (words_rev_iter == words_rev.end())
+         if (not (in >> word and word == "@"))
          {
-            string msg("unexpected word during initial MAC: `");
-            msg += word + '\'';
+            throw error(__FILE__, __LINE__, "expected `@' alone before the id of the key");
+         }
+         for (uint16_t &w: h.key)
+         {
+            if (not (in >> word and words_rev.find(word, w)))
+            {
+               throw error(__FILE__, __LINE__, "unexpected word in the id of the key");
+            }
+         }
+         h.has_key_id = true;
+      }
+      if ((in >> ws).peek() == cipher_mark)
+      {
+         in >> word;
+         char text[small_string::size()];
+         word.copy_to(text);
+         const string name(text + 1, word.length() - 1);
+         if (not find_cipher(name, h.cipher))
+         {
+            throw error(__FILE__, __LINE__, "unknown cipher `" + name + '\'');
+         }
+      }
+      return h;
+   }
+
+   void read_mac(mac_words &mac, const char *const where)
+   {
+      for (uint16_t &w: mac)
+      {
+         if (in >> word)
+         {
+            if (not words_rev.find(word, w))
+            {
+               string msg("unexpected word during ");
+               msg.append(where).append(": `");
+               msg += word + '\'';
+               throw error(__FILE__, __LINE__, msg);
+            }
+         }
+         else
+         {
+            string msg("unexpected ");
+            msg += in.eof() ? "EOF" : "word too long `";
+            if (not in.eof()) msg += word + '`';
+            msg.append(" during ").append(where);
             throw error(__FILE__, __LINE__, msg);
          }
-         expectedMac[macPos] = words_rev_iter->second;
       }
-      else
+      // check how the initial MAC ends and if it is present
+      if (not data and not (in >> word and (word == "," or word == ";")))
+      {
+         throw error(__FILE__, __LINE__, "expected `,' to terminate the initial MAC");
+      }
+      data = true;
+   }
+
+   // returns false after the data
+   bool next(uint16_t &index)
+   {
+      if (in >> word)
+      {
+         if (words_rev.find(word, index)) return true;
+         if (word == ".") return false; // found the marker between the data and the MAC
+         string msg("unexpected word: `");
+         msg += word + '\'';
+         throw error(__FILE__, __LINE__, msg);
+      }
+      if (not in.eof())
       {
          string msg("unexpected ");
-         msg += in.eof() ? "EOF" : "word too long `";
-         if (not in.eof()) msg += word + '`';
-         msg += " during initial MAC";
+         msg += "word too long `";
+         msg += word + '`';
          throw error(__FILE__, __LINE__, msg);
       }
+      return false; // the final MAC is missing
    }
-   // check how the initial MAC ends and if it is present
-   if (in >> word and word == ",")
-   { // nothing to do
+};
+
+// the same in the raw format: the integers are read in big-endian order and
+// the data ends where only the final MAC is left
+class raw_source
+{
+   static constexpr size_t mac_size = tuple_size<mac_words>::value * sizeof(uint16_t);
+   istream &in;
+   char buffer[1 << 16];
+   size_t begin = 0, end = 0;
+
+   // makes at least size bytes available unless in ends before
+   size_t available(const size_t size)
+   {
+      if (end - begin < size and in)
+      {
+         memmove(buffer, buffer + begin, end - begin);
+         end -= begin;
+         begin = 0;
+         in.read(buffer + end, sizeof buffer - end);
+         end += in.gcount();
+      }
+      return end - begin;
    }
-   else
+
+public:
+   explicit raw_source(istream &in)
+      : in(in)
    {
-      throw error(__FILE__, __LINE__, "expected `,' to terminate the initial MAC");
+      if (available(sizeof raw_magic) < sizeof raw_magic
+         or memcmp(buffer, raw_magic, sizeof raw_magic) != 0)
+      {
+         throw error(__FILE__, __LINE__, "not a raw encoded stream");
+      }
+      begin += sizeof raw_magic;
    }
 
-   while (in >> word)
+   void read_mac(mac_words &mac, const char *const where)
    {
-      const auto words_rev_iter = words_rev.find(word);
-      if (words_rev_iter == words_rev.end())
+      if (available(mac_size) < mac_size)
       {
-         if (word == ".")
-         { // found the marker between the data and the MAC
-            goto last_block;
-         }
-         else
-         {
-            string msg("unexpected word: `");
-            msg += word + '\'';
-            throw error(__FILE__, __LINE__, msg);
-         }
+         throw error(__FILE__, __LINE__, string("unexpected EOF during ") + where);
       }
-      char *pbuffer;
-      if (0 != (pbuffer = bufferise_data(buffers, words_rev_iter->second)))
-      { // the buffer is full
+      for (uint16_t &w: mac)
+      {
+         w = readu16(buffer + begin);
+         begin += sizeof w;
+      }
+   }
 
-         // convert to native integers
-         const streamsize data_size = BUFFER_SIZE / sizeof(uint32);
-         uint32 native_buffer[data_size];
-         for (streamsize i = 0; i < data_size; ++i) {
-            native_buffer[i] = readu32(pbuffer + sizeof(uint32) * i);
-         }
+   bool next(uint16_t &index)
+   {
+      const size_t size = available(mac_size + sizeof index);
+      if (size < mac_size + sizeof index)
+      {
+         if (size == mac_size) return false;
+         throw error(__FILE__, __LINE__, size < mac_size ? "unexpected EOF during final MAC" : "odd size of raw data");
+      }
+      index = readu16(buffer + begin);
+      begin += sizeof index;
+      return true;
+   }
+};
+
+}
+
+// decodes the data of an encoded stream in either format, see text_source
+template <class Source>
+static mac_words decode_source(Source &source, const block_cipher &cipher, CbcMac &mac,
+                                ostream &out, block_cache *const cache)
+{
+   Buffers buffers;
+   mac_words expectedMac = {};
+   source.read_mac(expectedMac, "initial MAC");
+   bool initial_checked = false;
+   streamsize nb_blocks = 0;
+   // what the cipher adds to the integers of each block
+   const streamsize overhead = cipher.overhead();
+   assert(overhead * sizeof(uint32) <= block_buffer::slack);
+   const streamsize block_size = BUFFER_SIZE + overhead * sizeof(uint32);
+
+   uint16_t index;
+   while (source.next(index))
+   {
+      uint32 *native_buffer;
+      if (0 != (native_buffer = bufferise_data(buffers, index, block_size)))
+      { // the buffer is full
+         const streamsize data_size = NATIVE_BUFFER_SIZE + overhead;
 
          // update mac with encrypted data
          mac_process_buffer(native_buffer, data_size, mac);
 
-         if (macPos == sizeof expectedMac / sizeof *expectedMac)
+         if (not initial_checked)
          { // have a complete inital MAC to check
             check_mac(mac, "initial", expectedMac);
-            macPos = 0; // don't check till the final block and final MAC
+            initial_checked = true; // don't check till the final block and final MAC
          }
 
-         // decrypt
-         BOOL btea_result = btea(native_buffer, -data_size, static_key);
-         if (not btea_result)
+         bool hit = false;
+         block_cache::entry *cached = nullptr;
+         if (cache != nullptr)
          {
-            ostringstream msg;
-            msg << "btea failed with size " << -data_size;
-            throw error(__FILE__, __LINE__, msg.str());
+            cached = &cache->lookup(reinterpret_cast<const char*>(native_buffer), block_size, hit);
+         }
+         if (hit)
+         { // the same ciphertext gives the same plaintext
+            memcpy(native_buffer, cached->value.data(), BUFFER_SIZE);
          }
+         else
+         {
+            // decrypt
+            if (not cipher.crypt(native_buffer, -data_size))
+            {
+               ostringstream msg;
+               msg << "the cipher failed with size " << -data_size;
+               throw error(__FILE__, __LINE__, msg.str());
+            }
 
-         // convert back to bytes
-         for (streamsize i = 0; i < data_size; ++i) {
-            writeu32(pbuffer + sizeof(uint32) * i, native_buffer[i]);
+            // convert back to bytes in place
+            for (streamsize i = 0; i < NATIVE_BUFFER_SIZE; ++i) {
+               native_buffer[i] = htonl(native_buffer[i]);
+            }
+            if (cached != nullptr)
+            {
+               cached->value.assign(reinterpret_cast<const char*>(native_buffer), BUFFER_SIZE);
+            }
          }
+         buffers.firstSize() = BUFFER_SIZE; // without what the cipher added
+         ENCODE_PROBE2(decode_block, nb_blocks, BUFFER_SIZE);
+         ++nb_blocks;
          remove_padding(buffers, out);
       }
    }
 
-   if (not in.eof())
-   {
-      string msg("unexpected ");
-      msg += "word too long `";
-      msg += word + '`';
-      throw error(__FILE__, __LINE__, msg);
-   }
-
-last_block:
    // special case for the last block, which may be partial
    const streamsize data_size = buffers.firstSize();
-   char *const pbuffer = buffers.first();
+   uint32 *const native_buffer = buffers.first();
+   if (data_size % sizeof(uint32) != 0)
+   { // the encoding pads the data to whole integers
+      throw error(__FILE__, __LINE__, "odd number of words in the last block");
+   }
 
    // when the previous block ends on a block boundary, there may be no data left
+   const streamsize contents_size = data_size / sizeof(uint32);
    if (data_size > 0)
    {
-      // convert to native integers
-      const streamsize contents_size = data_size / sizeof(uint32);
-      uint32 native_buffer[NATIVE_BUFFER_SIZE];
-      for (streamsize i = 0; i < contents_size; ++i) {
-         native_buffer[i] = readu32(pbuffer + sizeof(uint32) * i);
-      }
-
       // update mac with encrypted data
       mac_process_buffer(native_buffer, contents_size, mac);
+   }
 
-      // check the final MAC before finishing
-      // TODO: if (not in.good()) make this optional?
-      for (macPos = 0; macPos < macDigestSizeInWords; ++macPos)
-      {
-         if (in >> word)
-         {
-            const auto words_rev_iter = words_rev.find(word);
-            if (words_rev_iter == words_rev.end())
-            {
-               string msg("unexpected word during final MAC: `");
-               msg += word + '\'';
-               throw error(__FILE__, __LINE__, msg);
-            }
-            expectedMac[macPos] = words_rev_iter->second;
-         }
-         else
-         {
-            string msg("unexpected ");
-            msg += in.eof() ? "EOF" : "word too long `";
-            if (not in.eof()) msg += word + '`';
-            msg += " during final MAC";
-            throw error(__FILE__, __LINE__, msg);
-         }
-      }
-      check_mac(mac, "final", expectedMac);
+   if (not initial_checked)
+   { // the last block is also the first one
+      check_mac(mac, "initial", expectedMac);
+   }
+
+   // check the final MAC before finishing, even when the last block is empty
+   source.read_mac(expectedMac, "final MAC");
+   check_mac(mac, "final", expectedMac);
 
+   if (data_size > 0)
+   {
       // decrypt
-      BOOL btea_result = btea(native_buffer, -contents_size, static_key);
-      if (not btea_result)
+      if (not cipher.crypt(native_buffer, -contents_size))
       {
          ostringstream msg;
-         msg << "btea failed with size " << -contents_size;
+         msg << "the cipher failed with size " << -contents_size;
          throw error(__FILE__, __LINE__, msg.str());
       }
 
-      // convert back to bytes
-      for (streamsize i = 0; i < contents_size; ++i) {
-         writeu32(pbuffer + sizeof(uint32) * i, native_buffer[i]);
+      // convert back to bytes in place, without what the cipher added
+      const streamsize plain_size = contents_size - overhead;
+      for (streamsize i = 0; i < plain_size; ++i) {
+         native_buffer[i] = htonl(native_buffer[i]);
       }
+      buffers.firstSize() = plain_size * sizeof(uint32);
 
+      ENCODE_PROBE2(decode_block, nb_blocks, buffers.firstSize());
       remove_padding(buffers, out);
    }
 
    remove_padding(buffers, out); // flush any buffered data
+   return expectedMac;
+}
+
+mac_words decode(const word_index &words_rev, istream &in, ostream &out, block_cache *const cache)
+{
+   text_source source(words_rev, in);
+   const stream_header header = source.header();
+   const cipher_key &key = header.has_key_id ? find_key(header.key) : static_key;
+   CbcMac mac(key, header.cipher);
+   return decode_source(source, *make_cipher(header.cipher, key), mac, out, cache);
+}
+
+mac_words decode_chained(const word_index &words_rev, istream &in, ostream &out,
+                         uint32 (&mac_state)[CbcMac::stateSize])
+{
+   text_source source(words_rev, in);
+   CbcMac mac(static_key);
+   mac.restore(mac_state);
+   const mac_words result = decode_source(source, *static_cipher, mac, out, nullptr);
+   copy(begin(mac.currentState()), end(mac.currentState()), mac_state);
+   return result;
+}
+
+mac_words decode_raw(istream &in, ostream &out)
+{
+   raw_source source(in);
+   CbcMac mac(static_key);
+   return decode_source(source, *static_cipher, mac, out, nullptr);
+}
+
+namespace {
+
+// gives what is written to an encoder
+class encoder_streambuf: public streambuf
+{
+   Encoder &encoder;
+
+protected:
+   int_type overflow(int_type c) override
+   {
+      if (not traits_type::eq_int_type(c, traits_type::eof()))
+      {
+         const char byte = traits_type::to_char_type(c);
+         encoder.write(&byte, 1);
+      }
+      return traits_type::not_eof(c);
+   }
+   streamsize xsputn(const char *s, const streamsize n) override
+   {
+      encoder.write(s, n);
+      return n;
+   }
+
+public:
+   explicit encoder_streambuf(Encoder &encoder)
+      : encoder(encoder)
+   {}
+};
+
+}
+
+mac_words rekey(const word_list &words, const word_index &words_rev,
+                const cipher_key &old_key, const cipher_key &new_key,
+                istream &in, ostream &out)
+{
+   // the new encoding keeps the cipher of the old one, and names its key if it did
+   text_source source(words_rev, in);
+   const stream_header header = source.header();
+   if (header.has_key_id and header.key != key_fingerprint(old_key))
+   {
+      throw error(__FILE__, __LINE__, "the stream was encrypted with another key than the old key");
+   }
+   Encoder encoder(words, out);
+   encoder.use_key(new_key);
+   encoder.use_cipher(header.cipher);
+   if (header.has_key_id)
+   {
+      encoder.use_key_id();
+   }
+   encoder_streambuf plain_buffer(encoder);
+   ostream plain(&plain_buffer);
+   plain.exceptions(ios::badbit); // the errors of the encoder go through
+
+   CbcMac mac(old_key, header.cipher);
+   decode_source(source, *make_cipher(header.cipher, old_key), mac, plain, nullptr);
+   return encoder.finish();
+}
+
+void render(const word_list &words, istream &in, ostream &out)
+{
+   raw_source source(in);
+   mac_words mac;
+   source.read_mac(mac, "initial MAC");
+   for (const uint16_t w: mac)
+   {
+      out << words[w] << ' ';
+   }
+   out << ",\n";
+
+   // the blocks hold whole lines, so the lines follow the words of all the data
+   constexpr size_t word_size = small_string::size();
+   char text[1 << 16];
+   size_t size = 0;
+   uint16_t index;
+   for (size_t count = 0; source.next(index); ++count)
+   {
+      if (size > sizeof text - word_size - 1)
+      {
+         out.write(text, size);
+         size = 0;
+      }
+      char word[word_size];
+      words[index].copy_to(word);
+      memcpy(text + size, word, word_size);
+      size += words[index].length();
+      text[size++] = count % 8 != 7 ? ' ' : '\n';
+   }
+   out.write(text, size);
+
+   source.read_mac(mac, "final MAC");
+   out << ".\n";
+   for (const uint16_t w: mac)
+   {
+      out << words[w] << ' ';
+   }
+   out << '\n';
+}
+
+void unrender(const word_index &words_rev, istream &in, ostream &out)
+{
+   text_source source(words_rev, in);
+   mac_words mac;
+   char bytes[1 << 16];
+
+   out.write(raw_magic, sizeof raw_magic);
+   source.read_mac(mac, "initial MAC");
+   raw_mac_output(mac, out);
+   size_t size = 0;
+   uint16_t index;
+   while (source.next(index))
+   {
+      if (size == sizeof bytes)
+      {
+         out.write(bytes, size);
+         size = 0;
+      }
+      const uint16_t big_endian = htons(index);
+      memcpy(bytes + size, &big_endian, sizeof big_endian);
+      size += sizeof big_endian;
+   }
+   out.write(bytes, size);
+   source.read_mac(mac, "final MAC");
+   raw_mac_output(mac, out);
+}
+
+static uint16_t lookup_word(const word_index &words_rev,
+                            const small_string &word, const char *const where)
+{
+   uint16_t index;
+   if (not words_rev.find(word, index))
+   {
+      string msg("unexpected word ");
+      msg.append(where).append(": `");
+      msg += word + '\'';
+      throw error(__FILE__, __LINE__, msg);
+   }
+   return index;
+}
+
+static void read_mac(const word_index &words_rev, istream &in,
+                     mac_words &mac, const char *const where)
+{
+   small_string word;
+   for (auto &w: mac)
+   {
+      if (not (in >> word))
+      {
+         string msg("unexpected ");
+         msg += in.eof() ? "EOF" : "word too long";
+         msg.append(" during ").append(where);
+         throw error(__FILE__, __LINE__, msg);
+      }
+      w = lookup_word(words_rev, word, where);
+   }
+}
+
+// the native integers of the encrypted data are pairs of words
+static streamsize words_to_native(const vector<small_string> &block,
+                                  const word_index &words_rev,
+                                  uint32 *const native_buffer)
+{
+   if (block.size() % 2 != 0 or block.size() < 4 or block.size() > size_t(BUFFER_SIZE / sizeof(uint16_t)))
+   {
+      throw error(__FILE__, __LINE__, "invalid size of the last block");
+   }
+   for (size_t i = 0; i < block.size(); i += 2)
+   {
+      native_buffer[i / 2] = uint32(lookup_word(words_rev, block[i], "in the last block")) << 16
+         | lookup_word(words_rev, block[i + 1], "in the last block");
+   }
+   return block.size() / 2;
+}
+
+// Append and --base rebuild the blocks and the MAC of a stream encoded with
+// the loaded key and btea, so they refuse a stream which names another.
+static void check_default_header(const word_index &words_rev, istream &in, const char *const what)
+{
+   const stream_header header = text_source(words_rev, in).header();
+   if (header.has_key_id or header.cipher != cipher_id::xxtea)
+   {
+      throw error(__FILE__, __LINE__, string(what) + " only supports the default xxtea stream without a key id");
+   }
+}
+
+// decrypts the native integers of a block of such a stream back to its bytes
+static void decrypt_default_block(uint32 *const native_buffer, const streamsize data_size, const streamsize block)
+{
+   if (not static_cipher->crypt(native_buffer, -data_size))
+   {
+      ostringstream msg;
+      msg << "the cipher failed with size " << -data_size;
+      throw error(__FILE__, __LINE__, msg.str());
+   }
+   for (streamsize i = 0; i < data_size; ++i) {
+      native_buffer[i] = htonl(native_buffer[i]);
+   }
+   ENCODE_PROBE2(decode_block, block, data_size * sizeof(uint32));
+}
+
+resume_point find_last_block(const word_index &words_rev, istream &in)
+{
+   constexpr size_t block_words = BUFFER_SIZE / sizeof(uint16_t);
+   resume_point point;
+   streamsize next_offset = 0; // after the current block if it is complete
+   vector<small_string> block;
+   block.reserve(block_words);
+
+   check_default_header(words_rev, in, "append");
+   mac_words mac;
+   read_mac(words_rev, in, mac, "initial MAC");
+   small_string word;
+   if (not (in >> word and word == ","))
+   {
+      throw error(__FILE__, __LINE__, "expected `,' to terminate the initial MAC");
+   }
+
+   while (in >> word and not (word == "."))
+   {
+      if (block.size() == block_words)
+      { // another block follows
+         ++point.blocks;
+         point.output_offset = next_offset;
+         block.clear();
+      }
+      block.push_back(word);
+      if (block.size() == block_words)
+      { // the new line after the last word of a block belongs to it
+         next_offset = in.tellg() + streamoff(1);
+      }
+   }
+   if (not (word == "."))
+   {
+      throw error(__FILE__, __LINE__, "expected `.' to terminate the data");
+   }
+   read_mac(words_rev, in, mac, "final MAC");
+
+   uint32 native_buffer[NATIVE_BUFFER_SIZE];
+   const streamsize data_size = words_to_native(block, words_rev, native_buffer);
+
+   uint32 digest[CbcMac::stateSize];
+   for (size_t i = 0; i < CbcMac::stateSize; ++i)
+   {
+      digest[i] = uint32(mac[2 * i]) << 16 | mac[2 * i + 1];
+   }
+   CbcMac cbc_mac(static_key);
+   cbc_mac.restoreFromDigest(digest);
+
+   // revert the updates of mac_process_buffer, last one first
+   streamsize i = (data_size - 1) / CbcMac::stateSize * CbcMac::stateSize;
+   uint32 mac_buffer[CbcMac::stateSize] = {};
+   copy(native_buffer + i, native_buffer + data_size, mac_buffer);
+   cbc_mac.revert(mac_buffer);
+   while (i > 0)
+   {
+      i -= CbcMac::stateSize;
+      cbc_mac.revert(reinterpret_cast<uint32 const (&)[CbcMac::stateSize]>(native_buffer[i]));
+   }
+
+   copy(&cbc_mac.currentState()[0], &cbc_mac.currentState()[CbcMac::stateSize], point.mac_state);
+   if (point.blocks == 0 and any_of(begin(point.mac_state), end(point.mac_state), [](uint32 x) { return x != 0; }))
+   { // a MAC starts from zero
+      throw error(__FILE__, __LINE__, "invalid final MAC");
+   }
+   return point;
+}
+
+void for_each_block(const word_index &words_rev, istream &in, const block_visitor &visit)
+{
+   constexpr size_t block_words = BUFFER_SIZE / sizeof(uint16_t);
+   vector<small_string> block;
+   block.reserve(block_words);
+   streamsize end = 0;
+   const block_buffer native_buffer;
+   CbcMac mac(static_key);
+   bool first = true;
+   streamsize nb_blocks = 0;
+
+   check_default_header(words_rev, in, "--base");
+   mac_words initial_mac;
+   read_mac(words_rev, in, initial_mac, "initial MAC");
+   small_string word;
+   if (not (in >> word and word == ","))
+   {
+      throw error(__FILE__, __LINE__, "expected `,' to terminate the initial MAC");
+   }
+
+   while (in >> word and not (word == "."))
+   {
+      if (block.size() == block_words)
+      { // another block follows
+         words_to_native(block, words_rev, native_buffer.data());
+         mac_process_buffer(native_buffer.data(), NATIVE_BUFFER_SIZE, mac);
+         if (first)
+         {
+            check_mac(mac, "initial", initial_mac);
+            first = false;
+         }
+         const uint32 (&mac_state)[CbcMac::stateSize] = mac.currentState();
+
+         decrypt_default_block(native_buffer.data(), NATIVE_BUFFER_SIZE, nb_blocks++);
+         visit(reinterpret_cast<const char*>(native_buffer.data()), end, mac_state);
+         block.clear();
+      }
+      block.push_back(word);
+      if (block.size() == block_words)
+      { // the new line after the last word of a block belongs to it
+         end = in.tellg() + streamoff(1);
+      }
+   }
+   if (not (word == "."))
+   {
+      throw error(__FILE__, __LINE__, "expected `.' to terminate the data");
+   }
+}
+
+void Encoder::reopen(const word_index &words_rev, istream &in,
+                     uint32 const (&mac_state)[CbcMac::stateSize], const streamsize blocks)
+{
+   resume(mac_state, blocks);
+
+   mac_words expected_mac;
+   small_string word;
+   if (blocks == 0)
+   { // the initial MAC will change with the first block
+      check_default_header(words_rev, in, "append");
+      read_mac(words_rev, in, expected_mac, "initial MAC");
+      if (not (in >> word and word == ","))
+      {
+         throw error(__FILE__, __LINE__, "expected `,' to terminate the initial MAC");
+      }
+   }
+
+   vector<small_string> block;
+   while (in >> word and not (word == "."))
+   {
+      block.push_back(word);
+      if (block.size() > size_t(BUFFER_SIZE / sizeof(uint16_t))) break;
+   }
+   const streamsize data_size = words_to_native(block, words_rev, buffer);
+   read_mac(words_rev, in, expected_mac, "final MAC");
+
+   CbcMac final_mac = mac;
+   mac_process_buffer(buffer, data_size, final_mac);
+   if (mac_to_words(final_mac) != expected_mac)
+   {
+      throw error(__FILE__, __LINE__, "the MAC state doesn't lead to the final MAC");
+   }
+
+   decrypt_default_block(buffer, data_size, blocks);
+   size = data_size * sizeof(uint32) - check_padding(bytes(), data_size * sizeof(uint32));
 }
 
-void generate_words(vector<small_string> &words)
+void generate_words(word_list &words)
 {
    clog << "opening words.txt..." << endl;
    vector<string> all_words;
@@ -489,7 +1383,7 @@ void generate_words(vector<small_string> &words)
    words.resize(all_words.size());
    for (size_t i = 0; i < all_words.size(); ++i)
    {
-      memcpy(words[i].data(), all_words[i].data(), all_words[i].length());
+      words[i].assign(all_words[i].data(), all_words[i].length());
    }
 
    if (words.size() != 1 << 16)
@@ -500,15 +1394,33 @@ void generate_words(vector<small_string> &words)
    }
 }
 
-bool quick_start(vector<small_string> &words)
+bool quick_start(word_list &words)
 {
-   clog << "trying to quickstart... " << flush;
-   ifstream sorted_words_file("words.quickstart");
-   small_string line;
-   while (sorted_words_file >> line)
+   clog << "trying to quickstart... ";
+   // read the file at once: extracting the words one by one with >> took
+   // most of the time of a short run
+   ifstream sorted_words_file("words.quickstart", ios::binary);
+   string contents;
+   if (sorted_words_file.seekg(0, ios::end))
+   {
+      contents.resize(std::max<streamoff>(0, sorted_words_file.tellg()));
+      sorted_words_file.seekg(0);
+      sorted_words_file.read(&contents[0], contents.size());
+      contents.resize(sorted_words_file.gcount());
+   }
+
+   words.reserve(1 << 16);
+   for (size_t begin = 0, end; begin < contents.size(); begin = end + 1)
    {
-      if ( ! line.empty())
-         words.push_back(line);
+      end = std::min(contents.find('\n', begin), contents.size());
+      const size_t length = end - begin;
+      if (length > small_string::size())
+      { // not a list of words
+         words.clear();
+         break;
+      }
+      if (length > 0)
+         words.emplace_back(contents.data() + begin, length);
    }
 
    streamsize size = words.size();
@@ -523,7 +1435,7 @@ bool quick_start(vector<small_string> &words)
    return result;
 }
 
-void save_words(const vector<small_string> &words)
+void save_words(const word_list &words)
 {
    ofstream sorted_words_file("words.quickstart");
    for (auto &word: words)
@@ -532,14 +1444,38 @@ void save_words(const vector<small_string> &words)
    }
 }
 
-void reverse_words(const vector<small_string> &words, unordered_map<small_string, uint16_t> &words_rev)
+word_index::word_index(const word_list &words)
+   : words(words)
 {
-   clog << "creating the map for the reversal..." << endl;
-   words_rev.reserve(1 << 16);
+   if (not is_sorted(words.rbegin(), words.rend()))
+   { // not a list made by generate_words
+      build_table();
+   }
+}
+
+bool word_index::search(const small_string &word, uint16_t &index) const
+{
+   const auto it = lower_bound(words.begin(), words.end(), word,
+      [](const small_string &a, const small_string &b) { return b < a; });
+   if (it == words.end() or *it != word) return false;
+   index = static_cast<uint16_t>(it - words.begin());
+   return true;
+}
+
+void word_index::build_table()
+{
+   if (not table.empty()) return;
+   clog << "creating the map for the reversal...\n";
+   table.assign(size_t(1) << table_bits, slot{0, 0});
    uint16_t j = 0;
    for (auto &word: words)
    {
-      words_rev[word] = j++;
+      size_t i = word.value * 0x9e3779b97f4a7c15u >> (64 - table_bits);
+      while (table[i].key != 0)
+      {
+         i = (i + 1) & (table.size() - 1);
+      }
+      table[i] = slot{word.value, j++};
    }
    assert(j == 0);
 }
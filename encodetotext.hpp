@@ -1,3 +1,10 @@
+#pragma once
+
+#include "arena.hpp"
+#include "block_cache.hpp"
+#include "crypto.hpp"
+
+#include <cctype>
 #include <cstdint>
 #include <exception>
 #include <string>
@@ -6,6 +13,7 @@
 #include <unordered_map>
 #include <vector>
 #include <array>
+#include <endian.h>
 #include <functional>
 
 struct error: std::exception
@@ -45,38 +53,94 @@ struct error: std::exception
    }
 };
 
-struct small_string: std::array<char, 8>
+/**
+ * A word of at most 8 characters packed in a single integer: the first
+ * character is the most significant byte and the bytes after the last
+ * character are zero. Comparing the integers compares the words in the
+ * lexical order of std::string, and the length is found from the trailing
+ * zero bytes.
+ */
+struct small_string
 {
+   std::uint64_t value = 0;
+
+   small_string() = default;
+
+   small_string(const char *s, const std::size_t length)
+   {
+      assign(s, length);
+   }
+
+   static constexpr std::size_t size()
+   {
+      return sizeof(std::uint64_t);
+   }
+
+   // length must not exceed size()
+   void assign(const char *s, const std::size_t length)
+   {
+      char temp[sizeof(std::uint64_t)] = {};
+      std::memcpy(temp, s, length);
+      std::memcpy(&value, temp, size());
+      value = be64toh(value);
+   }
+
+   // writes the size() bytes of the word, zeroes included
+   void copy_to(char (&buffer)[sizeof(std::uint64_t)]) const
+   {
+      const std::uint64_t big_endian = htobe64(value);
+      std::memcpy(buffer, &big_endian, size());
+   }
+
    std::size_t length() const
    {
-      const char *p = static_cast<const char*>(std::memchr(data(), 0, size()));
-      return p ? p - data() : size();
+      // each zero byte after the word adds 8 trailing zero bits
+      return size() - (value ? __builtin_ctzll(value) : 64) / 8;
    }
 
    bool empty() const
    {
-      return front() == 0;
+      return value == 0;
    }
 
    std::string operator + (const char c) const
    {
-      std::string r(data(), length());
+      char buffer[size()];
+      copy_to(buffer);
+      std::string r(buffer, length());
       r += c;
       return r;
    }
 
+   bool operator == (const small_string &s) const
+   {
+      return value == s.value;
+   }
+
+   bool operator != (const small_string &s) const
+   {
+      return value != s.value;
+   }
+
+   bool operator < (const small_string &s) const
+   {
+      return value < s.value;
+   }
+
    template <std::size_t S>
    bool operator == (const char (&a)[S]) const
    {
-      return std::memcmp(data(), a, S) == 0 && zeroes_from(S);
+      return value == pack(a);
    }
 
-   bool zeroes_from(std::size_t i) const
+   template <std::size_t S>
+   static constexpr std::uint64_t pack(const char (&a)[S])
    {
-      for (; i < size(); ++i)
-         if (operator[](i) != 0)
-            return false;
-      return true;
+      static_assert(S - 1 <= size(), "literal too long for a small_string");
+      std::uint64_t v = 0;
+      for (std::size_t i = 0; i < size(); ++i)
+         v = v << 8 | (i < S - 1 ? static_cast<unsigned char>(a[i]) : 0);
+      return v;
    }
 };
 
@@ -86,26 +150,42 @@ inline T min(T t, T u)
    return t < u ? t : u;
 }
 
+// reads a word at most one byte past its size: a longer one fails at once,
+// with s set to its start and the rest of it left in the stream
 inline std::istream& operator >> (std::istream &in, small_string &s)
 {
-   std::string temp;
-   if (in >> temp)
+   const std::istream::sentry skip_blanks(in);
+   if (not skip_blanks) return in;
+
+   std::streambuf *const source = in.rdbuf();
+   char buffer[small_string::size()];
+   std::size_t length = 0;
+   for (;;)
    {
-      if (temp.length() > s.size())
+      const int c = source->sgetc();
+      if (c == std::char_traits<char>::eof())
+      {
+         in.setstate(std::ios::eofbit);
+         break;
+      }
+      if (std::isspace(c)) break;
+      if (length == s.size())
       {
          in.setstate(std::ios::failbit); // string too long
-         // set s anyway
+         break;
       }
-      const auto length = min(s.size(), temp.length());
-      std::memcpy(s.data(), temp.data(), length);
-      std::memset(s.data() + length, 0, s.size() - length);
+      buffer[length++] = static_cast<char>(c);
+      source->sbumpc();
    }
+   s.assign(buffer, length);
    return in;
 }
 
 inline std::ostream& operator << (std::ostream &out, const small_string &s)
 {
-   return out.write(s.data(), s.length());
+   char buffer[small_string::size()];
+   s.copy_to(buffer);
+   return out.write(buffer, s.length());
 }
 
 namespace std
@@ -115,22 +195,223 @@ namespace std
       typedef small_string argument_type;
       typedef std::size_t result_type;
       result_type operator () (const argument_type &s) const
+      { // multiply-shift: the high bits of the product mix all the characters
+         return static_cast<result_type>(s.value * 0x9e3779b97f4a7c15u >> 32);
+      }
+   };
+}
+
+// the dictionary of 65536 words, in the arena
+typedef std::vector<small_string, arena_allocator<small_string>> word_list;
+
+/**
+ * The reverse lookup of the dictionary, from a word to its index.
+ * The dictionary is sorted in decreasing order, so without a table the word
+ * is searched in it: nothing is built for short streams. build_table makes
+ * an open addressing table for the long ones.
+ */
+class word_index
+{
+public:
+   explicit word_index(const word_list &words);
+
+   // returns false if the word isn't in the dictionary
+   bool find(const small_string &word, std::uint16_t &index) const
+   {
+      if (table.empty()) return search(word, index);
+      if (word.empty()) return false; // the key of the free slots
+      for (std::size_t i = word.value * 0x9e3779b97f4a7c15u >> (64 - table_bits); ; i = (i + 1) & (table.size() - 1))
       {
-         result_type h = 0x9e3779b9;
-         for (auto p = s.data(); p < s.data() + s.size() && *p; ++p)
+         if (table[i].key == word.value)
          {
-            h ^= *p;
-            h = (h << 7) ^ (h >> 25);
+            index = table[i].index;
+            return true;
          }
-         return h;
+         if (table[i].key == 0) return false;
       }
+   }
+
+   void build_table();
+
+private:
+   bool search(const small_string &word, std::uint16_t &index) const;
+
+   static constexpr int table_bits = 17; // load factor 0.5
+   struct slot
+   {
+      std::uint64_t key;
+      std::uint16_t index;
    };
-}
+   const word_list &words;
+   std::vector<slot, arena_allocator<slot>> table;
+};
 
+// the words of a MAC as written in an encoded stream
+typedef std::array<std::uint16_t, 10> mac_words;
+// a key of btea and of the MAC, as in encode.key
+typedef uint32 cipher_key[4];
+
+constexpr std::streamsize BUFFER_SIZE = CbcMac::stateSize * sizeof(uint32) << 10; // ensure multiple of sizeof(uint32) and CbcMac::stateSize
+constexpr std::streamsize NATIVE_BUFFER_SIZE = BUFFER_SIZE / sizeof(uint32);
+static_assert(block_buffer::size == BUFFER_SIZE, "a block_buffer doesn't hold a block");
+
+// the formats of an encoded stream: words separated by blanks, words padded
+// with blanks to 8 bytes, whose initial MAC ends with `;' instead of `,', or
+// the binary container of encode_raw
+enum class encoded_format { words, fixed, raw };
+// the start of a stream in the raw format
+constexpr char raw_magic[] = {'e', 'n', 'c', 'r', 'a', 'w', '1', '\n'};
+// starts the name of the cipher before the initial MAC, as in `~aes', when
+// it isn't btea: older decoders stop there instead of failing on the MAC
+constexpr char cipher_mark = '~';
+// starts the id of the key, before the cipher, as in `@ word word'
+constexpr char key_id_mark = '@';
+// the id of a key: the first words of a MAC of a constant with the key
+typedef std::array<std::uint16_t, 2> key_id;
+
+/**
+ * Encodes the data given to it block by block, as encode() does.
+ * The words of a block are written to out as soon as the block is complete,
+ * so that the encoding may be stopped between two blocks and resumed.
+ */
+class Encoder
+{
+public:
+   Encoder(const word_list &words, std::ostream &out, encoded_format format = encoded_format::words);
+
+   // reads from in until the current block is complete or in is exhausted
+   // and returns the number of bytes read
+   std::streamsize read(std::istream &in);
+   // adds data to the encoding
+   void write(const char *data, std::streamsize size);
+   // encodes the last block, which is padded, and writes the final MAC
+   mac_words finish();
+
+   // number of blocks written to out
+   std::streamsize blocks() const { return nb_blocks; }
+   uint32 const (& macState() const)[CbcMac::stateSize] { return mac.currentState(); }
+   // continues an encoding whose first `blocks` blocks are already in out
+   void resume(uint32 const (&mac_state)[CbcMac::stateSize], std::streamsize blocks);
+   // adds a block already encrypted, given by its native integers and the
+   // text of their words, instead of BUFFER_SIZE bytes of data
+   void write_encrypted(const uint32 *natives, const char *text, std::size_t text_size);
+   // encrypts with key, which must outlive the encoding, instead of the loaded key
+   void use_key(const cipher_key &key);
+   // encrypts the data and the MAC with another cipher than btea, in the words format
+   void use_cipher(cipher_id id);
+   // writes the id of the key before the initial MAC, in the words format
+   void use_key_id();
+   // the complete blocks are looked up in cache, which must outlive the encoding
+   void use_cache(block_cache &cache) { this->cache = &cache; }
+   // continues a finished encoding: in holds what follows its first `blocks`
+   // blocks, the last block and the final MAC, which is checked against the
+   // MAC state. The data of the last block is decrypted to be encoded again
+   // followed by what is added. With no block, in holds the whole stream.
+   void reopen(const word_index &words_rev, std::istream &in,
+               uint32 const (&mac_state)[CbcMac::stateSize], std::streamsize blocks);
+
+private:
+   void flush_block();
+   void write_initial_mac();
+   char *bytes() { return reinterpret_cast<char*>(buffer); }
+
+   const word_list &words;
+   std::ostream &out;
+   CbcMac mac;
+   const encoded_format format;
+   const cipher_key *key;
+   cipher_id cipher = cipher_id::xxtea;
+   std::shared_ptr<const block_cipher> data_cipher;
+   bool write_key_id = false;
+   std::streamsize nb_blocks = 0;
+   std::streamsize size = 0; // of the current block, in bytes
+   block_cache *cache = nullptr;
+   // the bytes of the current block, then its native integers in place
+   const block_buffer block;
+   uint32 *const buffer = block.data();
+};
+
+// where an encoding may continue: after `blocks` complete blocks, whose
+// words end at output_offset in the encoded stream, with this MAC state
+struct resume_point
+{
+   std::streamsize blocks = 0;
+   std::streamsize output_offset = 0;
+   uint32 mac_state[CbcMac::stateSize] = {};
+};
+
+// Reads an encoded stream through to find where its last block starts and
+// the MAC state there, by reverting its final MAC over the last block. As
+// Encoder::reopen, it refuses a stream with a key id or another cipher.
+resume_point find_last_block(const word_index &words_rev, std::istream &in);
+
+// Reads the blocks of an encoded stream which are followed by another one,
+// checking the initial MAC. For each block, visit gets its plaintext of
+// BUFFER_SIZE bytes, the offset where its words end and the MAC state after it.
+// A stream with a key id or another cipher is refused before any block.
+typedef std::function<void(const char *plain, std::streamsize end,
+                           uint32 const (&mac_state)[CbcMac::stateSize])> block_visitor;
+void for_each_block(const word_index &words_rev, std::istream &in, const block_visitor &visit);
+
+// loads encode.key, if any, as the key of the functions which don't take one
 void load_static_key();
-void encode(const std::vector<small_string> &words, std::istream &in, std::ostream &out);
-void decode(const std::unordered_map<small_string, std::uint16_t> &words_rev, std::istream &in, std::ostream &out);
-void generate_words(std::vector<small_string> &words);
-bool quick_start(std::vector<small_string> &words);
-void save_words(const std::vector<small_string> &words);
-void reverse_words(const std::vector<small_string> &words, std::unordered_map<small_string, std::uint16_t> &words_rev);
+// reads a key file, as written by make_key
+void load_key(const std::string &file, cipher_key &key);
+// Loads the keys listed in a keyring, one key file per line, if there is one,
+// skipping with a warning those which can't be read.
+// decode() takes the key of a stream with an id from the loaded key or them.
+void load_keyring(const std::string &file = "encode.keyring");
+key_id key_fingerprint(const cipher_key &key);
+// the MAC of native integers with the loaded key, as computed over the encrypted data
+mac_words authenticate(const uint32 *data, std::streamsize size);
+// The steps of an encoder, for those which write the blocks out of order:
+// pad_and_crypt pads the bytes of a block, then makes them native integers
+// and encrypts them in place, and returns their number with those the cipher
+// adds after them in the slack of the block_buffer. render_block writes
+// their words as in the encoded stream into text, which has room for all the
+// bytes of the last word, and returns the size of the words.
+std::streamsize pad_and_crypt(uint32 *native_buffer, std::streamsize &bytes);
+std::streamsize pad_and_crypt(uint32 *native_buffer, std::streamsize &bytes, const block_cipher &cipher);
+std::size_t render_block(const word_list &words, const uint32 *natives, std::streamsize size, char *text);
+// and the MAC of the blocks, updated in their order
+class stream_mac
+{
+public:
+   stream_mac();
+   void update(const uint32 *natives, std::streamsize size);
+   mac_words digest() const;
+
+private:
+   CbcMac mac;
+};
+
+// the MAC state before any data, with the loaded key
+void initial_mac_state(uint32 (&mac_state)[CbcMac::stateSize]);
+// both return the final MAC of the stream, which identifies its contents
+// with a cache, repeated blocks are encrypted or decrypted only once, and
+// decode finds the cipher and the id of the key in the stream
+mac_words encode(const word_list &words, std::istream &in, std::ostream &out,
+                 block_cache *cache = nullptr, cipher_id cipher = cipher_id::xxtea,
+                 bool with_key_id = false);
+mac_words decode(const word_index &words_rev, std::istream &in, std::ostream &out,
+                 block_cache *cache = nullptr);
+// The raw format holds the same stream in binary: a magic, the initial MAC,
+// the encrypted integers and the final MAC, all big-endian. It is a quarter
+// of the size of the words, and render and unrender convert between both
+// formats byte for byte without the key.
+mac_words encode_raw(std::istream &in, std::ostream &out);
+mac_words decode_raw(std::istream &in, std::ostream &out);
+void render(const word_list &words, std::istream &in, std::ostream &out);
+void unrender(const word_index &words_rev, std::istream &in, std::ostream &out);
+// decodes a message whose MAC continues from mac_state, as written by an
+// Encoder resumed there with no block, then sets mac_state to its end state
+mac_words decode_chained(const word_index &words_rev, std::istream &in, std::ostream &out,
+                         uint32 (&mac_state)[CbcMac::stateSize]);
+// Decodes in with old_key and encodes its plaintext with new_key into out in
+// the same pass, a block at a time: the plaintext is only held in memory.
+mac_words rekey(const word_list &words, const word_index &words_rev,
+                const cipher_key &old_key, const cipher_key &new_key,
+                std::istream &in, std::ostream &out);
+void generate_words(word_list &words);
+bool quick_start(word_list &words);
+void save_words(const word_list &words);
@@ -0,0 +1,205 @@
+#include "fdstream.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+static constexpr size_t page_size = 4096;
+
+// buffers are whole pages, which vmsplice maps into the pipe one by one
+static char *allocate_pages(const size_t size)
+{
+   return static_cast<char*>(aligned_alloc(page_size, (size + page_size - 1) / page_size * page_size));
+}
+
+fd_istreambuf::fd_istreambuf(const int fd, const size_t buffer_size)
+   : fd(fd), buffer_size(buffer_size)
+{}
+
+fd_istreambuf::~fd_istreambuf()
+{
+   free(buffer);
+}
+
+fd_istreambuf::int_type fd_istreambuf::underflow()
+{
+   if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+   if (buffer == nullptr and (buffer = allocate_pages(buffer_size)) == nullptr)
+   {
+      return traits_type::eof();
+   }
+
+   // the data has to reach user space anyway to be encoded, so a plain read
+   // into a large buffer is the cheapest way, pipe or not
+   ssize_t n;
+   do
+   {
+      n = read(fd, buffer, buffer_size);
+   }
+   while (n < 0 and errno == EINTR);
+   if (n <= 0) return traits_type::eof();
+
+   setg(buffer, buffer, buffer + n);
+   return traits_type::to_int_type(*gptr());
+}
+
+fd_istreambuf::pos_type fd_istreambuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which)
+{
+   if (not (which & ios_base::in)) return pos_type(off_type(-1));
+   const off_type buffered = egptr() - gptr();
+   if (dir == ios_base::cur)
+   {
+      off -= buffered; // the descriptor is ahead of the stream by what is buffered
+   }
+   const off_type result = lseek(fd, off, dir == ios_base::beg ? SEEK_SET : dir == ios_base::cur ? SEEK_CUR : SEEK_END);
+   if (result < 0) return pos_type(off_type(-1));
+   setg(buffer, buffer, buffer);
+   return pos_type(result);
+}
+
+fd_istreambuf::pos_type fd_istreambuf::seekpos(pos_type pos, ios_base::openmode which)
+{
+   return seekoff(off_type(pos), ios_base::beg, which);
+}
+
+fd_ostreambuf::fd_ostreambuf(const int fd, const size_t buffer_size)
+   : fd(fd), buffer_size((buffer_size + page_size - 1) / page_size * page_size)
+{}
+
+fd_ostreambuf::~fd_ostreambuf()
+{
+   sync();
+   free(buffers[0]);
+   free(buffers[1]);
+}
+
+bool fd_ostreambuf::allocate()
+{
+   struct stat st;
+   if (fstat(fd, &st) == 0 and S_ISFIFO(st.st_mode) and getenv("ENCODE_NO_SPLICE") == nullptr)
+   {
+      // a spliced buffer may be reused once a whole other buffer went in the
+      // pipe after it: this requires the pipe to hold no more than a buffer
+      fcntl(fd, F_SETPIPE_SZ, static_cast<int>(buffer_size)); // may fail above pipe-max-size
+      const int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+      use_splice = pipe_size > 0 and static_cast<size_t>(pipe_size) <= buffer_size;
+   }
+
+   buffers[0] = allocate_pages(buffer_size);
+   if (use_splice) buffers[1] = allocate_pages(buffer_size);
+   if (buffers[0] == nullptr or (use_splice and buffers[1] == nullptr)) return false;
+
+   setp(buffers[0], buffers[0] + buffer_size);
+   return true;
+}
+
+bool fd_ostreambuf::write_all(const char *data, size_t size)
+{
+   while (size > 0)
+   {
+      const ssize_t n = write(fd, data, size);
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
+         return false;
+      }
+      data += n;
+      size -= n;
+   }
+   return true;
+}
+
+bool fd_ostreambuf::splice_all(const char *data, size_t size)
+{
+   iovec iov = {const_cast<char*>(data), size};
+   while (iov.iov_len > 0)
+   {
+      const ssize_t n = vmsplice(fd, &iov, 1, 0);
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
+         if (iov.iov_len == size and (errno == EINVAL or errno == ENOSYS))
+         { // not supported after all
+            use_splice = false;
+            return write_all(data, size);
+         }
+         return false;
+      }
+      iov.iov_base = static_cast<char*>(iov.iov_base) + n;
+      iov.iov_len -= n;
+   }
+   return true;
+}
+
+bool fd_ostreambuf::flush_buffer()
+{
+   const size_t size = pptr() - pbase();
+   if (size == 0) return true;
+
+   if (use_splice and size == buffer_size)
+   { // the pages now belong to the pipe: fill the other buffer meanwhile
+      if (not splice_all(pbase(), size)) return false;
+      if (use_splice) current = 1 - current;
+   }
+   else if (not write_all(pbase(), size)) // a copy: the buffer is free again
+   {
+      return false;
+   }
+
+   setp(buffers[current], buffers[current] + buffer_size);
+   return true;
+}
+
+fd_ostreambuf::int_type fd_ostreambuf::overflow(int_type c)
+{
+   if (pbase() == nullptr)
+   {
+      if (not allocate()) return traits_type::eof();
+   }
+   else if (not flush_buffer())
+   {
+      return traits_type::eof();
+   }
+
+   if (not traits_type::eq_int_type(c, traits_type::eof()))
+   {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+   }
+   return traits_type::not_eof(c);
+}
+
+streamsize fd_ostreambuf::xsputn(const char *s, const streamsize n)
+{
+   streamsize done = 0;
+   while (done < n)
+   {
+      if (pptr() == epptr() and traits_type::eq_int_type(overflow(traits_type::eof()), traits_type::eof()))
+      {
+         break;
+      }
+      const streamsize chunk = std::min<streamsize>(n - done, epptr() - pptr());
+      memcpy(pptr(), s + done, chunk);
+      pbump(static_cast<int>(chunk));
+      done += chunk;
+   }
+   return done;
+}
+
+int fd_ostreambuf::sync()
+{
+   return pbase() == nullptr or flush_buffer() ? 0 : -1;
+}
+
+fd_ostreambuf::pos_type fd_ostreambuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which)
+{
+   if (not (which & ios_base::out) or sync() != 0) return pos_type(off_type(-1));
+   const off_type result = lseek(fd, off, dir == ios_base::beg ? SEEK_SET : dir == ios_base::cur ? SEEK_CUR : SEEK_END);
+   return result < 0 ? pos_type(off_type(-1)) : pos_type(result);
+}
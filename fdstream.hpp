@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <streambuf>
+
+// Stream buffers over a file descriptor with a large buffer, for stdin and
+// stdout which otherwise go through the small buffers of cin and cout.
+// The buffers are allocated on the first use.
+
+constexpr std::size_t default_fd_buffer_size = std::size_t(4) << 20;
+
+class fd_istreambuf: public std::streambuf
+{
+public:
+   explicit fd_istreambuf(int fd, std::size_t buffer_size = default_fd_buffer_size);
+   ~fd_istreambuf();
+
+protected:
+   int_type underflow() override;
+   pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+   pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+   fd_istreambuf(const fd_istreambuf&) = delete;
+   fd_istreambuf& operator= (const fd_istreambuf&) = delete;
+
+   const int fd;
+   const std::size_t buffer_size;
+   char *buffer = nullptr;
+};
+
+// When the descriptor is a pipe, the full buffers are given to the pipe with
+// vmsplice instead of being copied by write. This is disabled by setting the
+// environment variable ENCODE_NO_SPLICE, which is needed when the reader of
+// the pipe splices its pages further and keeps them past the pipe.
+class fd_ostreambuf: public std::streambuf
+{
+public:
+   explicit fd_ostreambuf(int fd, std::size_t buffer_size = default_fd_buffer_size);
+   ~fd_ostreambuf();
+
+protected:
+   int_type overflow(int_type c) override;
+   std::streamsize xsputn(const char *s, std::streamsize n) override;
+   int sync() override;
+   pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+
+private:
+   fd_ostreambuf(const fd_ostreambuf&) = delete;
+   fd_ostreambuf& operator= (const fd_ostreambuf&) = delete;
+
+   bool allocate();
+   bool flush_buffer();
+   bool write_all(const char *data, std::size_t size);
+   bool splice_all(const char *data, std::size_t size);
+
+   const int fd;
+   const std::size_t buffer_size;
+   char *buffers[2] = {nullptr, nullptr};
+   int current = 0;
+   bool use_splice = false;
+};
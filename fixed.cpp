@@ -0,0 +1,183 @@
+#include "fixed.hpp"
+#include "parallel.hpp"
+
+#include <arpa/inet.h>
+
+using namespace std;
+
+// each word takes 8 bytes and a blank
+static constexpr size_t field_size = small_string::size() + 1;
+static constexpr size_t mac_fields = tuple_size<mac_words>::value;
+// the fields of a thread
+static constexpr size_t task_fields = 1 << 14;
+// the most fields read at once: 64 MiB of text, from a task for a short stream
+static constexpr size_t batch_fields = (64 << 20) / field_size / task_fields * task_fields;
+
+mac_words encode_fixed(const word_list &words, istream &in, ostream &out)
+{
+   Encoder encoder(words, out, encoded_format::fixed);
+   while (in.good())
+   {
+      encoder.read(in);
+   }
+   return encoder.finish();
+}
+
+namespace {
+
+// reads a stream of fixed width words as the stream of decode_raw()
+class fixed_raw_streambuf: public streambuf
+{
+   const word_index &words_rev;
+   istream &in;
+   const unsigned threads;
+   string text;      // of the fields being read
+   vector<char> raw; // what they give
+   bool started = false, finished = false;
+   size_t batch = task_fields; // the fields read at once
+
+   // the index of the word in a field
+   uint16_t parse(const char *field) const;
+   // reads the initial MAC and its `;'
+   void read_header();
+   // reads the final MAC after the `.' at the start of text
+   void read_trailer();
+
+protected:
+   int_type underflow() override;
+
+public:
+   fixed_raw_streambuf(const word_index &words_rev, istream &in, unsigned threads)
+      : words_rev(words_rev), in(in), threads(threads)
+   {}
+};
+
+}
+
+uint16_t fixed_raw_streambuf::parse(const char *const field) const
+{
+   uint64_t value;
+   memcpy(&value, field, sizeof value);
+   value = be64toh(value);
+   // the blanks of the padding are dropped
+   const uint64_t blanks = value ^ 0x2020202020202020u;
+   const unsigned padding = blanks ? __builtin_ctzll(blanks) / 8 : small_string::size();
+   small_string word;
+   word.value = padding ? value & ~((uint64_t(1) << 8 * padding) - 1) : value;
+
+   uint16_t index;
+   if (padding == small_string::size() or not isspace(static_cast<unsigned char>(field[small_string::size()]))
+      or not words_rev.find(word, index))
+   {
+      throw error(__FILE__, __LINE__, "unexpected word in the field `"
+         + string(field, small_string::size()) + "' of a fixed width stream");
+   }
+   return index;
+}
+
+static void append_u16(vector<char> &raw, const uint16_t value)
+{
+   const uint16_t big_endian = htons(value);
+   const char *const bytes = reinterpret_cast<const char*>(&big_endian);
+   raw.insert(raw.end(), bytes, bytes + sizeof big_endian);
+}
+
+void fixed_raw_streambuf::read_header()
+{
+   text.resize(mac_fields * field_size + 2);
+   in.read(&text[0], text.size());
+   if (in.gcount() != streamsize(text.size()) or text.compare(mac_fields * field_size, 2, ";\n") != 0)
+   {
+      throw error(__FILE__, __LINE__, "not a fixed width encoded stream");
+   }
+   raw.assign(raw_magic, raw_magic + sizeof raw_magic);
+   for (size_t i = 0; i < mac_fields; ++i)
+   {
+      append_u16(raw, parse(&text[i * field_size]));
+   }
+}
+
+void fixed_raw_streambuf::read_trailer()
+{
+   const size_t trailer_size = 2 + mac_fields * field_size;
+   if (text.size() < trailer_size)
+   {
+      const size_t size = text.size();
+      text.resize(trailer_size);
+      in.read(&text[size], trailer_size - size);
+      if (in.gcount() != streamsize(trailer_size - size))
+      {
+         throw error(__FILE__, __LINE__, "unexpected EOF during final MAC");
+      }
+   }
+   if (text[1] != '\n')
+   {
+      throw error(__FILE__, __LINE__, "expected `.' to terminate the data");
+   }
+   for (size_t i = 0; i < mac_fields; ++i)
+   {
+      append_u16(raw, parse(&text[2 + i * field_size]));
+   }
+}
+
+fixed_raw_streambuf::int_type fixed_raw_streambuf::underflow()
+{
+   if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+   if (finished) return traits_type::eof();
+
+   raw.clear();
+   if (not started)
+   {
+      read_header();
+      started = true;
+   }
+
+   text.resize(batch * field_size);
+   in.read(&text[0], text.size());
+   text.resize(in.gcount());
+
+   // the data ends with a field which starts with `.', or with the stream
+   size_t count = text.size() / field_size;
+   bool marker = false;
+   for (size_t i = 0; i < count; ++i)
+   {
+      if (text[i * field_size] == '.')
+      {
+         count = i;
+         marker = true;
+         break;
+      }
+   }
+   // without the marker, the final MAC is missing: decode_raw() tells it
+   finished = marker or count < batch;
+
+   const size_t start = raw.size();
+   raw.resize(start + count * sizeof(uint16_t));
+   parallel_for((count + task_fields - 1) / task_fields, threads, [&](const size_t task)
+   {
+      const size_t end = std::min(count, (task + 1) * task_fields);
+      for (size_t i = task * task_fields; i < end; ++i)
+      {
+         const uint16_t big_endian = htons(parse(&text[i * field_size]));
+         memcpy(&raw[start + i * sizeof big_endian], &big_endian, sizeof big_endian);
+      }
+   });
+
+   if (marker)
+   {
+      text.erase(0, count * field_size);
+      read_trailer();
+   }
+   batch = std::min(batch * 2, batch_fields);
+   if (raw.empty()) return traits_type::eof();
+   setg(raw.data(), raw.data(), raw.data() + raw.size());
+   return traits_type::to_int_type(*gptr());
+}
+
+mac_words decode_fixed(const word_index &words_rev, istream &in, ostream &out, const unsigned threads)
+{
+   fixed_raw_streambuf raw_buffer(words_rev, in, threads);
+   istream raw_in(&raw_buffer);
+   raw_in.exceptions(ios::badbit); // the errors of the fields go through
+   return decode_raw(raw_in, out);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Encodes in like encode(), with each word padded with blanks to 8 bytes:
+// word k of the data starts at an offset computed from k. The stream is
+// larger, but decode() still reads it since the padding is blank.
+mac_words encode_fixed(const word_list &words, std::istream &in, std::ostream &out);
+
+// Decodes a stream of encode_fixed: the words are read as 8 byte fields at
+// their offsets by `threads` threads, a batch at a time, and their integers
+// go to decode_raw().
+mac_words decode_fixed(const word_index &words_rev, std::istream &in, std::ostream &out,
+                       unsigned threads);
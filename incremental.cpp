@@ -0,0 +1,297 @@
+#include "incremental.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char block_list_magic[] = "encodetotext-blocks";
+static constexpr int block_list_version = 1;
+
+namespace {
+
+struct block_entry
+{
+   uint64_t hash;     // of the plaintext
+   streamsize end;    // offset after the words of the block
+   uint32 mac_state[CbcMac::stateSize];
+};
+
+// the complete blocks of an encoded file, all but its last one
+struct block_list
+{
+   streamsize encoded_size = 0;
+   vector<block_entry> blocks;
+};
+
+}
+
+static string block_list_name(const string &encoded_file)
+{
+   return encoded_file + ".blocks";
+}
+
+static streamsize file_size(const string &file)
+{
+   struct stat file_stat;
+   return stat(file.c_str(), &file_stat) == 0 ? file_stat.st_size : -1;
+}
+
+// ties the list to the key, which must not change between runs
+static mac_words check(const block_list &list)
+{
+   vector<uint32> data;
+   data.reserve(4 + list.blocks.size() * (4 + CbcMac::stateSize));
+   data.push_back(uint32(list.encoded_size >> 32));
+   data.push_back(uint32(list.encoded_size));
+   data.push_back(uint32(uint64_t(list.blocks.size()) >> 32));
+   data.push_back(uint32(list.blocks.size()));
+   for (const block_entry &b: list.blocks)
+   {
+      data.insert(data.end(), {uint32(b.hash >> 32), uint32(b.hash), uint32(b.end >> 32), uint32(b.end)});
+      data.insert(data.end(), begin(b.mac_state), end(b.mac_state));
+   }
+   return authenticate(data.data(), data.size());
+}
+
+static void save_block_list(const string &name, const block_list &list)
+{
+   const string temp_name = name + ".tmp";
+   {
+      ofstream out(temp_name);
+      out << block_list_magic << ' ' << block_list_version << '\n'
+          << list.encoded_size << ' ' << list.blocks.size() << '\n';
+      for (const block_entry &b: list.blocks)
+      {
+         out << b.hash << ' ' << b.end;
+         for (const uint32 x: b.mac_state)
+         {
+            out << ' ' << x;
+         }
+         out << '\n';
+      }
+      for (const uint16_t w: check(list))
+      {
+         out << w << ' ';
+      }
+      out << '\n';
+      if (not out.flush())
+      {
+         throw error(__FILE__, __LINE__, "cannot write " + temp_name);
+      }
+   }
+   if (rename(temp_name.c_str(), name.c_str()) != 0)
+   {
+      throw error(__FILE__, __LINE__, "cannot replace " + name);
+   }
+}
+
+static block_list load_block_list(const string &name)
+{
+   ifstream in(name);
+   if (not in)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + name);
+   }
+
+   string magic;
+   int version = 0;
+   size_t count = 0;
+   block_list list;
+   in >> magic >> version >> list.encoded_size >> count;
+   if (not in or magic != block_list_magic or version != block_list_version)
+   {
+      throw error(__FILE__, __LINE__, "invalid block list " + name);
+   }
+   for (size_t i = 0; i < count and in; ++i)
+   {
+      block_entry b;
+      in >> b.hash >> b.end;
+      for (uint32 &x: b.mac_state)
+      {
+         in >> x;
+      }
+      list.blocks.push_back(b);
+   }
+   mac_words expected_check;
+   for (uint16_t &w: expected_check)
+   {
+      in >> w;
+   }
+   if (not in or expected_check != check(list))
+   {
+      throw error(__FILE__, __LINE__, "block list " + name + " is corrupted or from another key");
+   }
+   return list;
+}
+
+// decodes the base to list its blocks, and checks it against its plaintext
+static block_list recover_block_list(const word_index &words_rev,
+                                     const string &base_encoded, const string &base_plain)
+{
+   ifstream encoded(base_encoded, ios::binary), plain(base_plain, ios::binary);
+   if (not encoded or not plain)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + (encoded ? base_plain : base_encoded));
+   }
+
+   block_list list;
+   list.encoded_size = file_size(base_encoded);
+   vector<char> plain_block(BUFFER_SIZE);
+   for_each_block(words_rev, encoded, [&](const char *data, const streamsize words_end,
+                                          uint32 const (&mac_state)[CbcMac::stateSize])
+   {
+      if (not plain.read(plain_block.data(), BUFFER_SIZE) or not equal(plain_block.begin(), plain_block.end(), data))
+      {
+         throw error(__FILE__, __LINE__, base_plain + " isn't the plaintext of " + base_encoded);
+      }
+      block_entry b{block_hash(data, BUFFER_SIZE), words_end, {}};
+      copy(begin(mac_state), end(mac_state), b.mac_state);
+      list.blocks.push_back(b);
+   });
+   return list;
+}
+
+// the list of the base, saved by the last incremental encoding or recovered
+static block_list base_block_list(const word_index &words_rev,
+                                  const string &base_encoded, const string &base_plain)
+{
+   try
+   {
+      block_list list = load_block_list(block_list_name(base_encoded));
+      if (list.encoded_size != file_size(base_encoded))
+      {
+         throw error(__FILE__, __LINE__, "the block list is for another version of " + base_encoded);
+      }
+      return list;
+   }
+   catch (const exception &exc)
+   {
+      clog << "no usable block list (" << exc.what() << "), decoding " << base_encoded << '\n';
+   }
+   return recover_block_list(words_rev, base_encoded, base_plain);
+}
+
+// the native integers of the words of a block, from the text of the base
+static void text_to_native(const word_index &words_rev, const string &text, uint32 *const native_buffer)
+{
+   streamsize count = 0;
+   for (size_t begin = 0; begin < text.size(); )
+   {
+      if (isspace(static_cast<unsigned char>(text[begin])))
+      {
+         ++begin;
+         continue;
+      }
+      size_t end = begin;
+      while (end < text.size() and not isspace(static_cast<unsigned char>(text[end]))) ++end;
+
+      uint16_t index;
+      if (end - begin > small_string::size() or count == BUFFER_SIZE / streamsize(sizeof(uint16_t))
+         or not words_rev.find(small_string(text.data() + begin, end - begin), index))
+      {
+         throw error(__FILE__, __LINE__, "unexpected word in a block of the base");
+      }
+      native_buffer[count / 2] = count % 2 == 0 ? uint32(index) << 16 : native_buffer[count / 2] | index;
+      ++count;
+      begin = end;
+   }
+   if (count != BUFFER_SIZE / streamsize(sizeof(uint16_t)))
+   {
+      throw error(__FILE__, __LINE__, "incomplete block in the base");
+   }
+}
+
+mac_words encode_incremental(const word_list &words,
+                             const word_index &words_rev,
+                             istream &in,
+                             const string &output_file, ostream &out,
+                             const string &base_encoded, const string &base_plain)
+{
+   if (output_file == "-" or output_file == base_encoded)
+   {
+      throw error(__FILE__, __LINE__, "an incremental encoding needs a named output file other than its base");
+   }
+
+   const block_list base = base_block_list(words_rev, base_encoded, base_plain);
+   ifstream encoded(base_encoded, ios::binary), plain(base_plain, ios::binary);
+   if (not encoded or not plain)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + (encoded ? base_plain : base_encoded));
+   }
+
+   Encoder encoder(words, out);
+   block_list list;
+   vector<char> block(BUFFER_SIZE), plain_block(BUFFER_SIZE);
+   const block_buffer native_buffer;
+   string text;
+   size_t prefix = 0, reused = 0, changed = 0;
+   for (size_t i = 0; ; ++i)
+   {
+      in.read(block.data(), BUFFER_SIZE);
+      const streamsize size = in.gcount();
+
+      // a block is reused if it is complete and its plaintext didn't change
+      bool same = size == BUFFER_SIZE and i < base.blocks.size()
+         and plain.read(plain_block.data(), BUFFER_SIZE)
+         and block_hash(plain_block.data(), BUFFER_SIZE) == base.blocks[i].hash
+         and block == plain_block;
+      if (same and i == prefix)
+      { // the words and the MAC state are those of the base so far
+         ++prefix;
+      }
+      else
+      {
+         if (i == prefix and prefix > 0)
+         { // the encoding diverges from the base: copy the blocks before
+            const streamsize copied = base.blocks[prefix - 1].end;
+            text.resize(copied);
+            if (not encoded.seekg(0) or not encoded.read(&text[0], copied))
+            {
+               throw error(__FILE__, __LINE__, "cannot read " + base_encoded);
+            }
+            out.write(text.data(), copied);
+            encoder.resume(base.blocks[prefix - 1].mac_state, prefix);
+            copy(base.blocks.begin(), base.blocks.begin() + prefix, back_inserter(list.blocks));
+         }
+
+         if (same)
+         {
+            const streamsize begin = base.blocks[i - 1].end;
+            text.resize(base.blocks[i].end - begin);
+            if (not encoded.seekg(begin) or not encoded.read(&text[0], text.size()))
+            {
+               throw error(__FILE__, __LINE__, "cannot read " + base_encoded);
+            }
+            text_to_native(words_rev, text, native_buffer.data());
+            encoder.write_encrypted(native_buffer.data(), text.data(), text.size());
+            ++reused;
+         }
+         else
+         {
+            encoder.write(block.data(), size);
+            if (size == BUFFER_SIZE) ++changed;
+         }
+         if (size == BUFFER_SIZE)
+         {
+            block_entry b{block_hash(block.data(), BUFFER_SIZE), streamsize(out.tellp()), {}};
+            copy(begin(encoder.macState()), end(encoder.macState()), b.mac_state);
+            list.blocks.push_back(b);
+         }
+      }
+      if (size < BUFFER_SIZE) break;
+   }
+
+   const mac_words final_mac = encoder.finish();
+   if (not out.flush() or (list.encoded_size = out.tellp()) < 0)
+   {
+      throw error(__FILE__, __LINE__, "cannot write " + output_file);
+   }
+   save_block_list(block_list_name(output_file), list);
+   clog << prefix << " blocks copied, " << reused << " reused, " << changed << " encoded again\n";
+   return final_mac;
+}
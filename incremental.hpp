@@ -0,0 +1,17 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Encodes in like encode() into the file output_file, reusing the blocks of
+// a previous encoding: base_encoded, whose plaintext is base_plain. A block
+// whose plaintext didn't change keeps its words, so that it isn't encrypted
+// or rendered again; the blocks before the first change are copied as they
+// are and skip the MAC too, since its chain is the same up to there.
+// The offsets, MAC states and plaintext hashes of the blocks are kept in
+// output_file.blocks for the next time; without a valid list next to
+// base_encoded, the list is first recovered by decoding base_encoded.
+mac_words encode_incremental(const word_list &words,
+                             const word_index &words_rev,
+                             std::istream &in,
+                             const std::string &output_file, std::ostream &out,
+                             const std::string &base_encoded, const std::string &base_plain);
@@ -0,0 +1,274 @@
+#include "multi.hpp"
+#include "parallel.hpp"
+
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+// the encoded bytes decoded at once: the input isn't held as a whole
+static constexpr size_t batch_bytes = 64 << 20;
+// the encoded bytes read at once from a message larger than a batch
+static constexpr size_t chunk_bytes = 1 << 16;
+
+namespace {
+
+// cuts an encoded stream after the final MAC of each message, without
+// decoding: the initial MAC ends with `,' or `;', the data with `.'
+class message_splitter
+{
+   streambuf *const source;
+   enum { initial_mac, data, final_mac } part = initial_mac;
+   bool started = false;   // by a word of the current message
+   size_t final_words = 0;
+   size_t word_size = 0;   // of the word being read
+   char word_first = '\0';
+
+   void reset()
+   {
+      part = initial_mac;
+      started = false;
+      final_words = word_size = 0;
+   }
+
+public:
+   explicit message_splitter(streambuf *source)
+      : source(source)
+   {}
+
+   enum result { none, partial, whole };
+   // Appends to text the bytes of the current message until its end, or
+   // until text holds limit bytes: partial, then the next call continues.
+   // Returns none when only blanks are left.
+   result next(string &text, size_t limit);
+};
+
+// the bytes of a message too large for a batch, as the splitter reads them
+class message_streambuf: public streambuf
+{
+   message_splitter &splitter;
+   string chunk;
+   bool complete = false;
+
+protected:
+   int_type underflow() override;
+
+public:
+   message_streambuf(message_splitter &splitter, string &&start)
+      : splitter(splitter), chunk(move(start))
+   {
+      setg(&chunk[0], &chunk[0], &chunk[0] + chunk.size());
+   }
+
+   // reads the rest of the message, which decode() may have left
+   void skip();
+};
+
+struct message
+{
+   string text;
+   string plain;
+   string failure;
+};
+
+}
+
+message_splitter::result message_splitter::next(string &text, const size_t limit)
+{
+   for (int c; text.size() < limit and (c = source->sbumpc()) != char_traits<char>::eof(); )
+   {
+      if (not isspace(c))
+      {
+         if (word_size++ == 0) word_first = static_cast<char>(c);
+         started = true;
+         text += static_cast<char>(c);
+         continue;
+      }
+      if (not started) continue; // the blanks between two messages are dropped
+      text += static_cast<char>(c);
+      if (word_size == 0) continue;
+
+      const bool mark = word_size == 1;
+      word_size = 0;
+      if (part == initial_mac and mark and (word_first == ',' or word_first == ';'))
+      {
+         part = data;
+      }
+      else if (part == data and mark and word_first == '.')
+      {
+         part = final_mac;
+      }
+      else if (part == final_mac and ++final_words == tuple_size<mac_words>::value)
+      {
+         reset();
+         return whole;
+      }
+   }
+   if (text.size() >= limit) return partial;
+   // a truncated message is returned too, to fail in decode()
+   const bool truncated = started;
+   reset();
+   return truncated ? whole : none;
+}
+
+message_streambuf::int_type message_streambuf::underflow()
+{
+   while (not complete)
+   {
+      chunk.clear();
+      complete = splitter.next(chunk, chunk_bytes) != message_splitter::partial;
+      if (not chunk.empty())
+      {
+         setg(&chunk[0], &chunk[0], &chunk[0] + chunk.size());
+         return traits_type::to_int_type(*gptr());
+      }
+   }
+   return traits_type::eof();
+}
+
+void message_streambuf::skip()
+{
+   while (not complete)
+   {
+      chunk.clear();
+      complete = splitter.next(chunk, chunk_bytes) != message_splitter::partial;
+   }
+   setg(nullptr, nullptr, nullptr);
+}
+
+static string message_name(const string &file, const size_t index)
+{
+   return file + '.' + to_string(index);
+}
+
+// decodes a message larger than a batch as it comes, like decode() alone
+// would: its plaintext isn't held either
+static bool decode_large(const word_index &words_rev, message_splitter &splitter, string &&start,
+                         const string &output_file, ostream &out, const bool split, const size_t index)
+{
+   message_streambuf buffer(splitter, move(start));
+   istream message_in(&buffer);
+   const string file = split ? message_name(output_file, index) : string();
+   try
+   {
+      if (split)
+      {
+         ofstream message_out(file, ios::binary);
+         decode(words_rev, message_in, message_out);
+         if (not message_out.flush())
+         {
+            throw error(__FILE__, __LINE__, "cannot write " + file);
+         }
+      }
+      else
+      {
+         decode(words_rev, message_in, out);
+      }
+      buffer.skip();
+      clog << "message " << index << ": decoded as it came\n";
+      return true;
+   }
+   catch (const exception &exc)
+   {
+      buffer.skip();
+      if (split) remove(file.c_str());
+      cerr << "message " << index << ": " << exc.what() << '\n';
+      return false;
+   }
+}
+
+void decode_multi(const word_index &words_rev, istream &in,
+                  const string &output_file, ostream &out,
+                  const bool split, const unsigned threads)
+{
+   if (split and output_file == "-")
+   {
+      throw error(__FILE__, __LINE__, "split messages need a named output file");
+   }
+
+   message_splitter splitter(in.rdbuf());
+   vector<message> batch;
+   size_t first = 0, failed = 0;
+   for (bool more = true; more; )
+   {
+      batch.clear();
+      string text, large;
+      for (size_t bytes = 0; bytes < batch_bytes; )
+      {
+         text.clear();
+         const message_splitter::result got = splitter.next(text, batch_bytes);
+         if (got == message_splitter::none)
+         {
+            more = false;
+            break;
+         }
+         if (got == message_splitter::partial)
+         { // decoded after the batch, which comes before it
+            large = move(text);
+            break;
+         }
+         bytes += text.size();
+         batch.push_back(message{move(text), {}, {}});
+      }
+
+      parallel_for(batch.size(), threads, [&](const size_t i)
+      {
+         message &m = batch[i];
+         try
+         {
+            istringstream message_in(m.text);
+            ostringstream plain;
+            decode(words_rev, message_in, plain);
+            m.plain = plain.str();
+            if (split)
+            {
+               const string file = message_name(output_file, first + i);
+               ofstream message_out(file, ios::binary);
+               if (not message_out.write(m.plain.data(), m.plain.size()).flush())
+               {
+                  throw error(__FILE__, __LINE__, "cannot write " + file);
+               }
+            }
+         }
+         catch (const exception &exc)
+         {
+            m.failure = exc.what();
+         }
+         m.text = string();
+      });
+
+      // the report and the output follow the order of the messages
+      for (size_t i = 0; i < batch.size(); ++i)
+      {
+         const message &m = batch[i];
+         if (not m.failure.empty())
+         {
+            cerr << "message " << first + i << ": " << m.failure << '\n';
+            ++failed;
+            continue;
+         }
+         if (not split and not out.write(m.plain.data(), m.plain.size()))
+         {
+            throw error(__FILE__, __LINE__, "cannot write the output");
+         }
+         clog << "message " << first + i << ": " << m.plain.size() << " bytes\n";
+      }
+      first += batch.size();
+
+      if (not large.empty())
+      {
+         if (not decode_large(words_rev, splitter, move(large), output_file, out, split, first)) ++failed;
+         ++first;
+      }
+   }
+
+   if (failed)
+   {
+      ostringstream msg;
+      msg << failed << " of " << first << " messages failed";
+      throw error(__FILE__, __LINE__, msg.str());
+   }
+   clog << first << " messages decoded\n";
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Decodes a stream of encoded messages written one after the other, as
+// several calls to encode() to the same output would. The boundaries are
+// found from the structure of the messages, which are then decoded with
+// `threads` threads. Their plaintexts are written in order to out, or to
+// files named after the output file with a suffix .0, .1, ... when split.
+// A message that fails is reported and left out; the others are kept.
+// A message larger than a batch of 64 MiB is decoded as it comes instead,
+// without being held: when it fails, what it wrote to out stays there.
+void decode_multi(const word_index &words_rev, std::istream &in,
+                  const std::string &output_file, std::ostream &out,
+                  bool split, unsigned threads);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// the number of threads to use when none is requested: one per core
+inline unsigned default_threads(const unsigned threads)
+{
+   return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls task(i) for each i in [0, count) from at most `threads` threads, each
+// thread taking the next index when it is done with the previous one.
+// The first exception thrown by a task is rethrown once all threads are done.
+template <class Task>
+void parallel_for(const std::size_t count, const unsigned threads, Task task)
+{
+   std::atomic<std::size_t> next(0);
+   std::exception_ptr failure;
+   std::mutex failure_mutex;
+   auto worker = [&]()
+   {
+      for (std::size_t i; (i = next++) < count; )
+      {
+         try
+         {
+            task(i);
+         }
+         catch (...)
+         {
+            std::lock_guard<std::mutex> lock(failure_mutex);
+            if (not failure) failure = std::current_exception();
+         }
+      }
+   };
+
+   std::vector<std::thread> pool;
+   const std::size_t nb_threads = std::min<std::size_t>(default_threads(threads), count);
+   for (std::size_t t = 1; t < nb_threads; ++t)
+   {
+      pool.emplace_back(worker);
+   }
+   worker(); // the calling thread works too
+   for (auto &thread: pool)
+   {
+      thread.join();
+   }
+
+   if (failure) std::rethrow_exception(failure);
+}
@@ -0,0 +1,169 @@
+#include "positional.hpp"
+#include "parallel.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// the blocks encoded at once: 64 MiB of input
+static constexpr size_t batch_blocks = 3200;
+
+namespace {
+
+// the output file, written at given offsets
+class positional_file
+{
+   int fd;
+   string name;
+
+public:
+   explicit positional_file(const string &name)
+      : fd(open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)), name(name)
+   {
+      if (fd < 0)
+      {
+         throw error(__FILE__, __LINE__, "cannot open " + name);
+      }
+   }
+   ~positional_file()
+   {
+      close(fd);
+   }
+   positional_file(const positional_file&) = delete;
+   positional_file& operator=(const positional_file&) = delete;
+
+   // reserves the blocks of a range before the threads write it
+   void reserve(const off_t offset, const off_t size)
+   {
+      if (size > 0 and fallocate(fd, 0, offset, size) != 0
+         and errno != EOPNOTSUPP and errno != ENOSYS)
+      {
+         throw error(__FILE__, __LINE__, "cannot allocate " + name + ": " + strerror(errno));
+      }
+   }
+
+   void write(const char *data, size_t size, off_t offset)
+   {
+      while (size > 0)
+      {
+         const ssize_t n = pwrite(fd, data, size, offset);
+         if (n < 0)
+         {
+            if (errno == EINTR) continue;
+            throw error(__FILE__, __LINE__, "cannot write " + name + ": " + strerror(errno));
+         }
+         data += n;
+         size -= n;
+         offset += n;
+      }
+   }
+};
+
+}
+
+static string mac_text(const word_list &words, const mac_words &mac)
+{
+   string text;
+   for (const uint16_t w: mac)
+   {
+      text += words[w] + ' ';
+   }
+   return text;
+}
+
+mac_words encode_positional(const word_list &words, istream &in,
+                            const string &output_file, const unsigned threads)
+{
+   if (output_file == "-")
+   {
+      throw error(__FILE__, __LINE__, "positional writes need a named output file");
+   }
+   positional_file out(output_file);
+
+   // the size of each word with its separator
+   uint8_t word_sizes[1 << 16];
+   for (size_t w = 0; w < words.size(); ++w)
+   {
+      word_sizes[w] = static_cast<uint8_t>(words[w].length() + 1);
+   }
+
+   vector<uint32> natives(batch_blocks * NATIVE_BUFFER_SIZE);
+   vector<streamsize> sizes(batch_blocks);   // in bytes, then in integers
+   vector<off_t> offsets(batch_blocks + 1);  // of the words of each block
+   stream_mac mac;
+   off_t offset = 0;
+   size_t nb_blocks = 0;
+   for (bool last = false; not last; )
+   {
+      in.read(reinterpret_cast<char*>(natives.data()), natives.size() * sizeof(uint32));
+      const streamsize bytes_read = in.gcount();
+      last = bytes_read < streamsize(natives.size() * sizeof(uint32));
+      // the last block is padded, even empty
+      const size_t count = bytes_read / BUFFER_SIZE + (last ? 1 : 0);
+      if (count == 0) break;
+
+      parallel_for(count, threads, [&](const size_t i)
+      {
+         uint32 *const block = natives.data() + i * NATIVE_BUFFER_SIZE;
+         sizes[i] = std::min<streamsize>(BUFFER_SIZE, bytes_read - i * BUFFER_SIZE);
+         sizes[i] = pad_and_crypt(block, sizes[i]);
+         off_t text_size = 0;
+         for (streamsize j = 0; j < sizes[i]; ++j)
+         {
+            text_size += word_sizes[block[j] >> 16] + word_sizes[block[j] & 0xffff];
+         }
+         offsets[i + 1] = text_size;
+      });
+
+      if (nb_blocks == 0)
+      { // the initial MAC goes before the words
+         mac.update(natives.data(), sizes[0]);
+         const string initial = mac_text(words, mac.digest()) + ",\n";
+         out.write(initial.data(), initial.size(), 0);
+         offset = initial.size();
+      }
+      offsets[0] = offset;
+      for (size_t i = 0; i < count; ++i)
+      {
+         offsets[i + 1] += offsets[i];
+      }
+      out.reserve(offsets[0], offsets[count] - offsets[0]);
+
+      // the MAC chain is the only part in order: it runs meanwhile
+      thread mac_thread([&]()
+      {
+         for (size_t i = nb_blocks == 0 ? 1 : 0; i < count; ++i)
+         {
+            mac.update(natives.data() + i * NATIVE_BUFFER_SIZE, sizes[i]);
+         }
+      });
+      try
+      {
+         parallel_for(count, threads, [&](const size_t i)
+         {
+            string text(offsets[i + 1] - offsets[i] + small_string::size(), '\0');
+            const size_t size = render_block(words, natives.data() + i * NATIVE_BUFFER_SIZE, sizes[i], &text[0]);
+            out.write(text.data(), size, offsets[i]);
+         });
+      }
+      catch (...)
+      {
+         mac_thread.join();
+         throw;
+      }
+      mac_thread.join();
+      offset = offsets[count];
+      nb_blocks += count;
+   }
+
+   const mac_words final_mac = mac.digest();
+   const string final_text = ".\n" + mac_text(words, final_mac) + '\n';
+   out.write(final_text.data(), final_text.size(), offset);
+   clog << nb_blocks << " blocks written\n";
+   return final_mac;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Encodes in like encode() into the file output_file, which the threads
+// write at once: the size of the words of each block is known from its
+// encrypted integers, so the offset of each block in the output is known
+// before it is rendered. The blocks are encrypted, then rendered and written
+// with pwrite by `threads` threads, while the MAC goes over them in order.
+mac_words encode_positional(const word_list &words, std::istream &in,
+                            const std::string &output_file, unsigned threads);
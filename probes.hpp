@@ -0,0 +1,29 @@
+#pragma once
+
+// Static tracepoints (USDT) of the provider encodetotext, for bpftrace or
+// perf probe: each is a nop in the code until a tracer attaches to it.
+//    block_read(block, bytes)         a block to encode is complete
+//    crypt_start(bytes), crypt_end(integers)
+//                                     around pad_and_crypt
+//    mac_update(integers)             the MAC goes over integers
+//    render_flush(bytes)              rendered words are written
+//    decode_block(block, bytes)       a block is decoded
+//    check_mac(kind, ok)              a MAC is checked, kind is a C string
+// They need <sys/sdt.h>, from systemtap-sdt-dev. The Makefile defines
+// ENCODE_NO_PROBES where it is missing, or with NO_PROBES=1, for a binary
+// without them, where they compile to nothing; PROBES=1 requires them.
+#ifndef ENCODE_NO_PROBES
+#if defined(__has_include) && !__has_include(<sys/sdt.h>)
+#error "<sys/sdt.h> is missing: install systemtap-sdt-dev or define ENCODE_NO_PROBES"
+#endif
+#include <sys/sdt.h>
+#define ENCODE_HAS_PROBES 1
+#endif
+
+#ifdef ENCODE_HAS_PROBES
+#define ENCODE_PROBE1(name, a) DTRACE_PROBE1(encodetotext, name, a)
+#define ENCODE_PROBE2(name, a, b) DTRACE_PROBE2(encodetotext, name, a, b)
+#else
+#define ENCODE_PROBE1(name, a) ((void)sizeof(a))
+#define ENCODE_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#endif
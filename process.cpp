@@ -1,11 +1,27 @@
 #include "encodetotext.hpp"
+#include "archive.hpp"
+#include "batch.hpp"
+#include "bounded.hpp"
+#include "checkpoint.hpp"
+#include "fdstream.hpp"
+#include "fixed.hpp"
+#include "incremental.hpp"
 #include "make_key.hpp"
+#include "multi.hpp"
+#include "positional.hpp"
+#include "segments.hpp"
+#include "stream.hpp"
+#include "tune.hpp"
 
+#include <algorithm>
+#include <charconv>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -15,36 +31,315 @@ static bool ends_with(const string_view str, const string_view end)
       && end == str.substr(str.size() - end.size());
 }
 
+static constexpr streamsize default_checkpoint_interval = streamsize(1) << 30;
+static constexpr int default_frame_ms = 100;
+static constexpr streamsize max_frame_bytes = streamsize(64) << 20; // a frame is held in memory
+
+/**
+ * Command line arguments of the enc and dec modes
+ */
+struct arguments
+{
+   string_view mode;
+   string_view input_file;
+   string_view output_file;
+   size_t segments = 0;          // enc: number of segments to split the input in
+   streamsize segment_size = 0;  // enc: size in bytes of each segment
+   bool segmented = false;       // dec: the input is a segment manifest
+   bool multi = false;           // dec: the input holds several messages
+   bool split = false;           // dec: one output file per message
+   streamsize checkpoint = 0;    // enc: bytes of input between two checkpoints
+   bool resume = false;          // enc: continue from the last checkpoint
+   bool append = false;          // enc: add the input at the end of the output
+   bool quiet = false;           // no progress messages
+   bool dedup = false;           // repeated blocks are encrypted once
+   bool raw = false;             // the encoded stream is in the binary format
+   bool fixed = false;           // the encoded words are padded to a fixed width
+   bool stream = false;          // the encoded stream is made of frames
+   bool parallel = false;        // enc: the blocks are written by several threads
+   cipher_id cipher = cipher_id::xxtea; // enc: the cipher of the data and the MAC
+   bool key_id = false;          // enc: the id of the key is written in the stream
+   bool archive = false;         // the plaintext is the files of a directory
+   string_view entry;            // dec: the only entry of the archive extracted
+   streamsize max_input = 0;     // dec: bytes of input allowed, 0 for any
+   streamsize max_output = 0;    // dec: bytes of output allowed, 0 for any
+   streamsize frame_bytes = 0;   // enc: bytes pending which flush a frame
+   int frame_ms = 0;             // enc: milliseconds after which pending bytes are flushed
+   string_view base_encoded;     // enc: previous output to reuse the blocks of
+   string_view base_plain;       // enc: and its input
+   string_view old_key_file;     // rekey: key of the input
+   string_view new_key_file;     // rekey: key of the output
+   unsigned threads = 0;         // 0 for one thread per core
+   streamoff short_input_size = 0; // of the input decoded without the table, from the tuning
+};
+
+/**
+ * Parses a positive number given to an option
+ *
+ * @param name Name of the option, for the error message
+ * @param value Text of the number
+ * @param number Output: the number
+ * @return true if value is a positive number, false otherwise
+ */
+template <class T>
+static bool parse_number(const string_view name, const string_view value, T& number)
+{
+   const auto result = from_chars(value.data(), value.data() + value.size(), number);
+   if (result.ec != errc() or result.ptr != value.data() + value.size() or number <= 0)
+   {
+      cerr << "option " << name << " expects a positive number, not " << value << '\n';
+      return false;
+   }
+   return true;
+}
+
+namespace {
+
+// the options which change how the data is encoded or decoded
+enum mode_option
+{
+   segments_option, checkpoint_option, append_option, segmented_option, multi_option, base_option,
+   dedup_option, raw_option, fixed_option, stream_option, parallel_option, limits_option,
+   cipher_option, archive_option, nb_mode_options
+};
+
+}
+
+static const char *const mode_option_names[nb_mode_options] = {
+   "--segments/--segment-size", "--checkpoint/--resume", "--append", "--segmented", "--multi", "--base",
+   "--dedup", "--raw", "--fixed", "--stream", "--parallel", "--max-input/--max-output",
+   "--cipher/--key-id", "--archive"
+};
+
+// the only pairs of mode options which may be given together: a new option
+// is exclusive of all the others until it is listed here
+static const mode_option combinable_pairs[][2] = {
+   {dedup_option, cipher_option},   // the cache works with any cipher and key
+   {raw_option, limits_option},     // decode_bounded reads the raw format too
+   {cipher_option, archive_option}, // an archive is encoded as a single stream
+};
+
+/**
+ * Checks that the mode options given may be combined, pair by pair
+ *
+ * @param args The options found
+ * @return true if every pair of mode options given is combinable, false otherwise
+ */
+static bool combinable_options(const arguments& args)
+{
+   bool given[nb_mode_options] = {};
+   given[segments_option] = args.segments or args.segment_size;
+   given[checkpoint_option] = args.checkpoint or args.resume;
+   given[append_option] = args.append;
+   given[segmented_option] = args.segmented;
+   given[multi_option] = args.multi;
+   given[base_option] = not args.base_encoded.empty();
+   given[dedup_option] = args.dedup;
+   given[raw_option] = args.raw;
+   given[fixed_option] = args.fixed;
+   given[stream_option] = args.stream;
+   given[parallel_option] = args.parallel;
+   given[limits_option] = args.max_input or args.max_output;
+   given[cipher_option] = args.cipher != cipher_id::xxtea or args.key_id;
+   given[archive_option] = args.archive;
+
+   for (int a = 0; a < nb_mode_options; ++a)
+   {
+      for (int b = a + 1; b < nb_mode_options; ++b)
+      {
+         const bool combinable = any_of(begin(combinable_pairs), end(combinable_pairs),
+                                        [&](const mode_option (&pair)[2])
+         {
+            return (pair[0] == a and pair[1] == b) or (pair[0] == b and pair[1] == a);
+         });
+         if (given[a] and given[b] and not combinable)
+         {
+            cerr << mode_option_names[a] << " and " << mode_option_names[b] << " are exclusive\n";
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+/**
+ * Parses the options given between the mode and the filenames
+ *
+ * @param argc Argument count
+ * @param argv Argument values
+ * @param i Input/Output: index of the first option, then of the first filename
+ * @param args Output: the options found
+ * @return true if the options are valid, false otherwise
+ */
+static bool parse_options(int argc, char *argv[], int& i, arguments& args)
+{
+   for ( ; i < argc and argv[i][0] == '-' and argv[i][1] == '-'; ++i)
+   {
+      const string_view option = argv[i];
+      const bool has_value = i + 1 < argc;
+      if (option == "--segments" and args.mode == "enc" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.segments)) return false;
+      }
+      else if (option == "--segment-size" and args.mode == "enc" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.segment_size)) return false;
+      }
+      else if (option == "--checkpoint" and args.mode == "enc" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.checkpoint)) return false;
+      }
+      else if (option == "--resume" and args.mode == "enc")
+      {
+         args.resume = true;
+      }
+      else if (option == "--append" and args.mode == "enc")
+      {
+         args.append = true;
+      }
+      else if (option == "--segmented" and args.mode == "dec")
+      {
+         args.segmented = true;
+      }
+      else if (option == "--multi" and args.mode == "dec")
+      {
+         args.multi = true;
+      }
+      else if (option == "--split" and args.mode == "dec")
+      {
+         args.split = true;
+      }
+      else if (option == "--base" and args.mode == "enc" and i + 2 < argc)
+      {
+         args.base_encoded = argv[++i];
+         args.base_plain = argv[++i];
+      }
+      else if (option == "--raw" and (args.mode == "enc" or args.mode == "dec"))
+      {
+         args.raw = true;
+      }
+      else if (option == "--fixed" and (args.mode == "enc" or args.mode == "dec"))
+      {
+         args.fixed = true;
+      }
+      else if (option == "--stream" and (args.mode == "enc" or args.mode == "dec"))
+      {
+         args.stream = true;
+      }
+      else if (option == "--parallel" and args.mode == "enc")
+      {
+         args.parallel = true;
+      }
+      else if (option == "--max-input" and args.mode == "dec" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.max_input)) return false;
+      }
+      else if (option == "--max-output" and args.mode == "dec" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.max_output)) return false;
+      }
+      else if (option == "--frame-bytes" and args.mode == "enc" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.frame_bytes)) return false;
+         if (args.frame_bytes > max_frame_bytes)
+         {
+            cerr << "option --frame-bytes is at most " << max_frame_bytes << " bytes, the size of a frame in memory\n";
+            return false;
+         }
+      }
+      else if (option == "--frame-ms" and args.mode == "enc" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.frame_ms)) return false;
+      }
+      else if (option == "--cipher" and args.mode == "enc" and has_value)
+      {
+         if (not find_cipher(argv[++i], args.cipher))
+         {
+            cerr << "unknown cipher " << argv[i] << " ; valid is xxtea or aes\n";
+            return false;
+         }
+      }
+      else if (option == "--archive" and (args.mode == "enc" or args.mode == "dec"))
+      {
+         args.archive = true;
+      }
+      else if (option == "--entry" and args.mode == "dec" and has_value)
+      {
+         args.entry = argv[++i];
+      }
+      else if (option == "--key-id" and args.mode == "enc")
+      {
+         args.key_id = true;
+      }
+      else if (option == "--dedup" and (args.mode == "enc" or args.mode == "dec"))
+      {
+         args.dedup = true;
+      }
+      else if (option == "--quiet")
+      {
+         args.quiet = true;
+      }
+      else if (option == "--threads" and has_value)
+      {
+         if (!parse_number(option, argv[++i], args.threads)) return false;
+      }
+      else
+      {
+         cerr << "invalid option " << option << " for mode " << args.mode << '\n';
+         return false;
+      }
+   }
+
+   if (args.segments and args.segment_size)
+   {
+      cerr << "--segments and --segment-size are exclusive\n";
+      return false;
+   }
+   if (args.split and not args.multi)
+   {
+      cerr << "--split needs --multi\n";
+      return false;
+   }
+   if ((args.frame_bytes or args.frame_ms) and not args.stream)
+   {
+      cerr << "--frame-bytes and --frame-ms need --stream\n";
+      return false;
+   }
+   if (not args.entry.empty() and not args.archive)
+   {
+      cerr << "--entry needs --archive\n";
+      return false;
+   }
+   return combinable_options(args);
+}
+
 /**
  * Parses command line arguments and validates them
  *
  * @param argc Argument count
  * @param argv Argument values
- * @param mode Output: processing mode (enc/dec/key)
- * @param input_file Output: input filename or "-" for stdin
- * @param output_file Output: output filename or "-" for stdout
+ * @param args Output: processing mode (enc/dec/key), options,
+ *        input filename or "-" for stdin and output filename or "-" for stdout
  * @return true if arguments are valid, false otherwise
  * @throws error if invalid arguments are provided
  */
-static bool parse_arguments(int argc, char *argv[],
-                          string_view& mode,
-                          string_view& input_file,
-                          string_view& output_file)
+static bool parse_arguments(int argc, char *argv[], arguments& args)
 {
    if (argc <= 1)
    {
-      cerr << "missing arguments: mode {enc, dec, key}, filename_in(or -) or password, [filename_out(or -)]\n";
+      cerr << "missing arguments: mode {enc, dec, key, batch, render, unrender, rekey, calibrate}, [options], filename_in(or -) or password, [filename_out(or -)]\n";
       return false;
    }
 
-   mode = argv[1];
-   if (mode != "enc" && mode != "dec" && mode != "key")
+   args.mode = argv[1];
+   if (args.mode != "enc" && args.mode != "dec" && args.mode != "key" && args.mode != "batch"
+       && args.mode != "render" && args.mode != "unrender" && args.mode != "rekey" && args.mode != "calibrate")
    {
-      cerr << "invalid mode " << mode << " ; valid is enc, dec or key\n";
+      cerr << "invalid mode " << args.mode << " ; valid is enc, dec, key, batch, render, unrender, rekey or calibrate\n";
       return false;
    }
 
-   if (mode == "key")
+   if (args.mode == "key")
    {
       // Key mode only needs password argument
       if (argc <= 2)
@@ -56,18 +351,60 @@ static bool parse_arguments(int argc, char *argv[],
       return true;
    }
 
-   // For enc/dec modes, we need input and output files
-   if (argc <= 3)
+   int i = 2;
+   if (!parse_options(argc, argv, i, args))
+   {
+      cerr << "options: enc [--segments N | --segment-size BYTES] [--checkpoint BYTES] [--resume] [--append] [--dedup]"
+              " [--base OLD_ENCODED OLD_PLAIN] [--raw | --fixed] [--stream [--frame-bytes BYTES] [--frame-ms MS]] [--parallel]"
+              " [--cipher xxtea|aes] [--key-id] [--archive]"
+              " [--threads N] [--quiet],"
+              " dec [--segmented | --multi [--split]] [--dedup] [--raw | --fixed] [--stream] [--archive [--entry PATH]]"
+              " [--max-input BYTES] [--max-output BYTES] [--threads N] [--quiet],"
+              " batch [--threads N] [--quiet], rekey [--quiet], calibrate [--quiet]\n";
+      return false;
+   }
+
+   if (args.mode == "batch")
+   { // the report of the jobs goes to stdout
+      if (argc <= i)
+      {
+         cerr << "missing arguments: mode {batch}, [options], manifest(or -)\n";
+         return false;
+      }
+      args.input_file = argv[i];
+      args.output_file = "-";
+      return true;
+   }
+
+   if (args.mode == "calibrate")
+   { // the profile is written at the end, nothing is read
+      args.output_file = argc > i ? argv[i] : default_tuning_file;
+      return true;
+   }
+
+   if (args.mode == "rekey")
+   { // the keys come before the files
+      if (argc <= i + 3)
+      {
+         cerr << "missing arguments: mode {rekey}, [options], old_key, new_key, filename_in(or -), filename_out(or -)\n";
+         return false;
+      }
+      args.old_key_file = argv[i++];
+      args.new_key_file = argv[i++];
+   }
+
+   // For the other modes, we need input and output files
+   if (argc <= i + 1)
    {
-      cerr << "missing arguments: mode {enc, dec}, filename_in(or -), filename_out(or -)\n";
+      cerr << "missing arguments: mode {enc, dec, render, unrender}, [options], filename_in(or -), filename_out(or -)\n";
       return false;
    }
 
-   input_file = argv[2];
-   output_file = argv[3];
+   args.input_file = argv[i];
+   args.output_file = argv[i + 1];
 
    // Basic protection of not overwriting our database
-   if (ends_with(output_file, "words.txt"))
+   if (ends_with(args.output_file, "words.txt"))
    {
       cerr << "cannot use words.txt as filename\n";
       return false;
@@ -81,15 +418,20 @@ static bool parse_arguments(int argc, char *argv[],
  *
  * @param input_file Input filename or "-" for stdin
  * @param output_file Output filename or "-" for stdout
+ * @param keep_output Whether an existing output file is kept instead of truncated
  * @param file_in Output: input file stream (if file used)
  * @param file_out Output: output file stream (if file used)
+ * @param std_in Stream over stdin (if "-" used)
+ * @param std_out Stream over stdout (if "-" used)
  * @param in Output: pointer to input stream
  * @param out Output: pointer to output stream
  * @return true if streams were set up successfully, false otherwise
  */
 static bool setup_io_streams(const string_view input_file,
                             const string_view output_file,
+                            const bool keep_output,
                             ifstream& file_in, ofstream& file_out,
+                            istream& std_in, ostream& std_out,
                             istream*& in, ostream*& out)
 {
    // Set up input stream
@@ -100,7 +442,7 @@ static bool setup_io_streams(const string_view input_file,
    }
    else
    {
-      in = &cin;
+      in = &std_in;
    }
 
    if (!*in)
@@ -112,12 +454,17 @@ static bool setup_io_streams(const string_view input_file,
    // Set up output stream
    if (output_file != "-")
    {
-      file_out.open(output_file.data(), ios::binary);
+      file_out.open(output_file.data(), keep_output ? ios::binary | ios::in : ios::binary);
+      if (!file_out and keep_output)
+      { // nothing to keep
+         file_out.clear();
+         file_out.open(output_file.data(), ios::binary);
+      }
       out = &file_out;
    }
    else
    {
-      out = &cout;
+      out = &std_out;
    }
 
    if (!*out)
@@ -134,9 +481,9 @@ static bool setup_io_streams(const string_view input_file,
  *
  * @return vector of small_string words for encoding/decoding
  */
-static vector<small_string> setup_word_list()
+static word_list setup_word_list()
 {
-   vector<small_string> words;
+   word_list words;
    if (!quick_start(words))
    {
       std::clock_t startTime(std::clock());
@@ -144,7 +491,7 @@ static vector<small_string> setup_word_list()
       generate_words(words);
 
       std::clock_t duration(std::clock() - startTime);
-      std::cerr << "generate_words in " << (float(duration) / CLOCKS_PER_SEC) << "s." << endl;
+      std::clog << "generate_words in " << (float(duration) / CLOCKS_PER_SEC) << "s." << endl;
 
       save_words(words);
    }
@@ -167,31 +514,188 @@ static int handle_key_mode(int argc, char *argv[])
    return make_key(argv[2]), 0;
 }
 
+/**
+ * Tells whether the input is known to be short enough to be decoded without
+ * the table of word_index, whose construction would take longer than
+ * searching each of its words in the dictionary
+ *
+ * @param in Input stream, left at its position
+ * @param short_input_size Size below which the input is short, about 8 bytes per word
+ * @return true if in is seekable and short
+ */
+static bool is_short_input(istream& in, const streamoff short_input_size)
+{
+   const streamoff start = in.tellg();
+   if (start < 0 or not in.seekg(0, ios::end))
+   {
+      in.clear();
+      return false;
+   }
+   const streamoff size = streamoff(in.tellg()) - start;
+   in.seekg(start);
+   return size < short_input_size;
+}
+
 /**
  * Performs the main encoding or decoding operation
  *
- * @param mode Processing mode ("enc" or "dec")
+ * @param args Processing mode ("enc", "dec", "batch", "render", "unrender" or "rekey"), options and filenames
  * @param words Word list for encoding
  * @param in Input stream
  * @param out Output stream
  * @return 0 on success, non-zero on error
  */
-static int perform_encoding_decoding(const string_view mode,
-                                    vector<small_string>& words,
+static int perform_encoding_decoding(const arguments& args,
+                                    word_list& words,
                                     istream& in, ostream& out)
 {
-   if (mode == "enc")
+   if (args.mode == "batch")
+   {
+      return run_batch(words, in, out, args.threads) ? 5 : 0;
+   }
+   else if (args.mode == "render")
+   {
+      render(words, in, out);
+   }
+   else if (args.mode == "unrender")
    {
-      cerr << "encoding the file..." << endl;
-      encode(words, in, out);
+      word_index words_rev(words);
+      if (!is_short_input(in, args.short_input_size))
+      {
+         words_rev.build_table();
+      }
+      unrender(words_rev, in, out);
+   }
+   else if (args.mode == "rekey")
+   {
+      cipher_key old_key, new_key;
+      load_key(string(args.old_key_file), old_key);
+      load_key(string(args.new_key_file), new_key);
+      word_index words_rev(words);
+      if (!is_short_input(in, args.short_input_size))
+      {
+         words_rev.build_table();
+      }
+      clog << "changing the key of the file...\n";
+      rekey(words, words_rev, old_key, new_key, in, out);
+   }
+   else if (args.mode == "enc")
+   {
+      if (not args.resume and not args.append and args.output_file != "-")
+      { // a checkpoint of what the output held before would splice the two
+         discard_checkpoint(string(args.output_file));
+      }
+      clog << "encoding the file...\n";
+      if (args.archive)
+      {
+         encode_archive(words, string(args.input_file), out, args.cipher, args.key_id);
+      }
+      else if (args.raw)
+      {
+         encode_raw(in, out);
+      }
+      else if (args.fixed)
+      {
+         encode_fixed(words, in, out);
+      }
+      else if (args.parallel)
+      {
+         encode_positional(words, in, string(args.output_file), args.threads);
+      }
+      else if (args.stream)
+      { // the input is polled to flush the frames in time
+         const int fd = args.input_file == "-" ? STDIN_FILENO : open(string(args.input_file).c_str(), O_RDONLY);
+         if (fd < 0)
+         {
+            throw error(__FILE__, __LINE__, "cannot open " + string(args.input_file));
+         }
+         encode_stream(words, fd, out, args.frame_bytes ? args.frame_bytes : BUFFER_SIZE,
+                       args.frame_ms ? args.frame_ms : default_frame_ms);
+         if (fd != STDIN_FILENO) close(fd);
+      }
+      else if (args.append)
+      {
+         // only the last block is read: searching the words is enough
+         const word_index words_rev(words);
+         encode_append(words, words_rev, in, string(args.output_file), out);
+      }
+      else if (not args.base_encoded.empty())
+      {
+         word_index words_rev(words);
+         words_rev.build_table();
+         encode_incremental(words, words_rev, in, string(args.output_file), out,
+                            string(args.base_encoded), string(args.base_plain));
+      }
+      else if (args.checkpoint or args.resume)
+      {
+         encode_with_checkpoints(words, string(args.input_file), in, string(args.output_file), out,
+                                 args.checkpoint ? args.checkpoint : default_checkpoint_interval, args.resume);
+      }
+      else if (args.segments or args.segment_size)
+      {
+         encode_segments(words, string(args.input_file), in, string(args.output_file), out,
+                         args.segments, args.segment_size, args.threads);
+      }
+      else if (args.dedup)
+      {
+         block_cache cache;
+         encode(words, in, out, &cache, args.cipher, args.key_id);
+         cache.report(clog);
+      }
+      else
+      {
+         encode(words, in, out, nullptr, args.cipher, args.key_id);
+      }
+   }
+   else if (args.raw and not (args.max_input or args.max_output))
+   {
+      clog << "decoding the file...\n";
+      decode_raw(in, out);
    }
    else
    {
-      unordered_map<small_string, uint16_t> words_rev;
-      reverse_words(words, words_rev);
+      word_index words_rev(words);
+      if (args.segmented or args.multi or !is_short_input(in, args.short_input_size))
+      {
+         words_rev.build_table();
+      }
 
-      cerr << "decoding the file..." << endl;
-      decode(words_rev, in, out);
+      clog << "decoding the file...\n";
+      if (args.archive)
+      {
+         decode_archive(words_rev, in, string(args.output_file), string(args.entry));
+      }
+      else if (args.fixed)
+      {
+         decode_fixed(words_rev, in, out, args.threads);
+      }
+      else if (args.max_input or args.max_output)
+      {
+         decode_bounded(words_rev, in, out, args.max_input, args.max_output, args.raw);
+      }
+      else if (args.segmented)
+      {
+         decode_segments(words_rev, string(args.input_file), in, string(args.output_file), out,
+                         args.threads);
+      }
+      else if (args.stream)
+      {
+         decode_stream(words_rev, in, out);
+      }
+      else if (args.multi)
+      {
+         decode_multi(words_rev, in, string(args.output_file), out, args.split, args.threads);
+      }
+      else if (args.dedup)
+      {
+         block_cache cache;
+         decode(words_rev, in, out, &cache);
+         cache.report(clog);
+      }
+      else
+      {
+         decode(words_rev, in, out);
+      }
    }
 
    return 0;
@@ -199,35 +703,74 @@ static int perform_encoding_decoding(const string_view mode,
 
 static int process(int argc, char *argv[])
 {
-   string_view mode;
-   string_view input_file;
-   string_view output_file;
+   arguments args;
    ifstream file_in;
    ofstream file_out;
+   // the parameters of this host, if it was calibrated
+   const tuning tune = load_tuning();
+   // large buffers instead of those of cin and cout for the pipes
+   fd_istreambuf stdin_buffer(STDIN_FILENO, tune.fd_buffer_size);
+   fd_ostreambuf stdout_buffer(STDOUT_FILENO, tune.fd_buffer_size);
+   istream std_in(&stdin_buffer);
+   ostream std_out(&stdout_buffer);
    istream *in;
    ostream *out;
 
    // Parse and validate arguments
-   if (!parse_arguments(argc, argv, mode, input_file, output_file))
+   if (!parse_arguments(argc, argv, args))
    {
       return 1; // Argument error
    }
 
-   if (mode == "key")
+   if (args.mode == "key")
    {
       return handle_key_mode(argc, argv);
    }
+   if (args.threads == 0)
+   {
+      args.threads = tune.threads;
+   }
+   args.short_input_size = tune.short_input_size;
+
+   // the progress messages are buffered but come before any error
+   cerr.tie(&clog);
+   if (args.quiet)
+   { // no output and no flush
+      clog.rdbuf(nullptr);
+   }
 
-   // Set up I/O streams
-   if (!setup_io_streams(input_file, output_file, file_in, file_out, in, out))
+   if (args.mode == "calibrate")
+   {
+      word_list words = setup_word_list();
+      load_static_key();
+      calibrate(words, string(args.output_file));
+      return 0;
+   }
+
+   // Set up I/O streams: the directory of an archive isn't one
+   const bool archive_input = args.archive and args.mode == "enc";
+   const bool archive_output = args.archive and args.mode == "dec";
+   if (!setup_io_streams(archive_input ? "-" : args.input_file, archive_output ? "-" : args.output_file,
+                         args.resume or args.append,
+                         file_in, file_out, std_in, std_out, in, out))
    {
       return 3; // I/O setup error
    }
 
-   vector<small_string> words = setup_word_list();
+   word_list words = setup_word_list();
    load_static_key();
+   if (args.mode == "dec" or args.mode == "rekey" or args.mode == "batch")
+   { // only a decoding looks a key up by its id, batch for its dec jobs
+      load_keyring();
+   }
 
-   return perform_encoding_decoding(mode, words, *in, *out);
+   const int result = perform_encoding_decoding(args, words, *in, *out);
+   if (!out->flush())
+   {
+      cerr << "error writing " << args.output_file << '\n';
+      return 4; // I/O error
+   }
+   return result;
 }
 
 int (*run)(int argc, char *argv[]) = process;
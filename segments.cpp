@@ -0,0 +1,334 @@
+#include "segments.hpp"
+#include "parallel.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <mutex>
+
+using namespace std;
+
+static const char manifest_magic[] = "encodetotext-segments";
+static constexpr int manifest_version = 1;
+
+namespace {
+
+// reads at most a given number of bytes from another stream buffer
+class slice_streambuf: public streambuf
+{
+   streambuf *const source;
+   streamsize remaining;
+   streamsize consumed = 0;
+   char buffer[1 << 16];
+
+protected:
+   int_type underflow() override
+   {
+      if (remaining == 0) return traits_type::eof();
+      const streamsize n = source->sgetn(buffer, std::min<streamsize>(remaining, sizeof buffer));
+      if (n <= 0) return traits_type::eof();
+      remaining -= n;
+      consumed += n;
+      setg(buffer, buffer, buffer + n);
+      return traits_type::to_int_type(*gptr());
+   }
+
+public:
+   slice_streambuf(streambuf *source, streamsize size)
+      : source(source), remaining(size)
+   {}
+
+   streamsize size() const { return consumed; }
+};
+
+// forwards to another stream buffer and counts the bytes written
+class counting_streambuf: public streambuf
+{
+   streambuf *const sink;
+   streamsize count = 0;
+
+protected:
+   int_type overflow(int_type c) override
+   {
+      if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+      if (traits_type::eq_int_type(sink->sputc(traits_type::to_char_type(c)), traits_type::eof()))
+         return traits_type::eof();
+      ++count;
+      return c;
+   }
+
+   streamsize xsputn(const char *s, streamsize n) override
+   {
+      n = sink->sputn(s, n);
+      count += n;
+      return n;
+   }
+
+   int sync() override
+   {
+      return sink->pubsync();
+   }
+
+public:
+   explicit counting_streambuf(streambuf *sink)
+      : sink(sink)
+   {}
+
+   streamsize size() const { return count; }
+};
+
+struct segment
+{
+   streamsize offset, size;
+   mac_words mac;
+};
+
+}
+
+static string segment_name(const string &file, const size_t index)
+{
+   return file + '.' + to_string(index);
+}
+
+static mac_words encode_segment(const word_list &words, streambuf *source,
+                                const string &file, segment &s)
+{
+   ofstream out(file, ios::binary);
+   if (not out)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + file);
+   }
+   slice_streambuf slice(source, s.size);
+   istream in(&slice);
+   const mac_words mac = encode(words, in, out);
+   if (not out.flush())
+   {
+      throw error(__FILE__, __LINE__, "cannot write " + file);
+   }
+   s.size = slice.size();
+   return mac;
+}
+
+void encode_segments(const word_list &words,
+                     const string &input_file, istream &in,
+                     const string &output_file, ostream &out,
+                     size_t count, streamsize segment_size, unsigned threads)
+{
+   if (output_file == "-")
+   {
+      throw error(__FILE__, __LINE__, "segments need a named output file");
+   }
+
+   // find the size of the input to place the segments
+   streamsize input_size = -1;
+   if (in.seekg(0, ios::end))
+   {
+      input_size = in.tellg();
+      in.seekg(0);
+   }
+   in.clear();
+
+   vector<segment> segments;
+   if (input_size >= 0)
+   {
+      if (count == 0)
+      {
+         count = input_size > 0 ? (input_size + segment_size - 1) / segment_size : 1;
+      }
+      for (size_t i = 0; i < count; ++i)
+      { // spread the bytes evenly when only the count is given
+         const streamsize begin = segment_size ? i * segment_size : input_size * i / count;
+         const streamsize end = segment_size ? std::min<streamsize>(input_size, begin + segment_size)
+                                             : input_size * (i + 1) / count;
+         segments.push_back(segment{begin, end - begin, {}});
+      }
+   }
+   else if (count != 0)
+   {
+      throw error(__FILE__, __LINE__, "a segment count needs a seekable input, use a segment size instead");
+   }
+
+   if (input_size >= 0 and input_file != "-")
+   { // each thread reads its own part of the input
+      parallel_for(segments.size(), threads, [&](const size_t i)
+      {
+         ifstream segment_in(input_file, ios::binary);
+         if (not segment_in.seekg(segments[i].offset))
+         {
+            throw error(__FILE__, __LINE__, "cannot read " + input_file);
+         }
+         segments[i].mac = encode_segment(words, segment_in.rdbuf(), segment_name(output_file, i), segments[i]);
+      });
+   }
+   else if (input_size >= 0)
+   {
+      for (size_t i = 0; i < segments.size(); ++i)
+      {
+         segments[i].mac = encode_segment(words, in.rdbuf(), segment_name(output_file, i), segments[i]);
+      }
+   }
+   else
+   { // cut the stream as it comes
+      streamsize offset = 0;
+      do
+      {
+         segments.push_back(segment{offset, segment_size, {}});
+         segments.back().mac = encode_segment(words, in.rdbuf(), segment_name(output_file, segments.size() - 1), segments.back());
+         offset += segments.back().size;
+      }
+      while (segments.back().size == segment_size
+         and in.rdbuf()->sgetc() != char_traits<char>::eof());
+   }
+
+   ostringstream manifest;
+   manifest << manifest_magic << ' ' << manifest_version << '\n'
+      << segments.size() << '\n';
+   for (size_t i = 0; i < segments.size(); ++i)
+   {
+      manifest << i << ' ' << segments[i].offset << ' ' << segments[i].size;
+      for (const auto w: segments[i].mac)
+      {
+         manifest << ' ' << w;
+      }
+      manifest << '\n';
+   }
+
+   istringstream manifest_in(manifest.str());
+   encode(words, manifest_in, out);
+   clog << segments.size() << " segments written\n";
+}
+
+static vector<segment> read_manifest(istream &manifest)
+{
+   string magic;
+   int version = 0;
+   size_t count = 0;
+   if (not (manifest >> magic >> version >> count) or magic != manifest_magic)
+   {
+      throw error(__FILE__, __LINE__, "not a segment manifest");
+   }
+   if (version != manifest_version)
+   {
+      throw error(__FILE__, __LINE__, "unsupported segment manifest version " + to_string(version));
+   }
+
+   vector<segment> segments(count);
+   streamsize offset = 0;
+   for (size_t i = 0; i < count; ++i)
+   {
+      size_t index;
+      segment &s = segments[i];
+      manifest >> index >> s.offset >> s.size;
+      for (auto &w: s.mac)
+      {
+         manifest >> w;
+      }
+      if (not manifest)
+      {
+         throw error(__FILE__, __LINE__, "truncated segment manifest");
+      }
+      // the segments must follow each other without gaps
+      if (index != i or s.offset != offset or s.size < 0)
+      {
+         throw error(__FILE__, __LINE__, "segment " + to_string(i) + " is out of order in the manifest");
+      }
+      offset += s.size;
+   }
+   return segments;
+}
+
+static void decode_segment(const word_index &words_rev,
+                           const string &file, streambuf *sink, const segment &s)
+{
+   ifstream in(file, ios::binary);
+   if (not in)
+   {
+      throw error(__FILE__, __LINE__, "missing segment " + file);
+   }
+   counting_streambuf counter(sink);
+   ostream out(&counter);
+   const mac_words mac = decode(words_rev, in, out);
+   if (not out.flush())
+   {
+      throw error(__FILE__, __LINE__, "cannot write the output of " + file);
+   }
+   // a valid segment from another place or another encoding has another MAC
+   if (mac != s.mac)
+   {
+      throw error(__FILE__, __LINE__, file + " isn't the segment listed in the manifest");
+   }
+   if (counter.size() != s.size)
+   {
+      ostringstream msg;
+      msg << file << " holds " << counter.size() << " bytes instead of " << s.size;
+      throw error(__FILE__, __LINE__, msg.str());
+   }
+}
+
+void decode_segments(const word_index &words_rev,
+                     const string &input_file, istream &in,
+                     const string &output_file, ostream &out,
+                     unsigned threads)
+{
+   if (input_file == "-")
+   {
+      throw error(__FILE__, __LINE__, "segments need a named manifest file");
+   }
+
+   stringstream manifest;
+   decode(words_rev, in, manifest);
+   const vector<segment> segments = read_manifest(manifest);
+
+   vector<string> failures(segments.size());
+   if (output_file != "-")
+   { // each thread writes its own part of the output
+      parallel_for(segments.size(), threads, [&](const size_t i)
+      {
+         try
+         {
+            fstream segment_out(output_file, ios::binary | ios::in | ios::out);
+            if (not segment_out.seekp(segments[i].offset))
+            {
+               throw error(__FILE__, __LINE__, "cannot write " + output_file);
+            }
+            decode_segment(words_rev, segment_name(input_file, i), segment_out.rdbuf(), segments[i]);
+         }
+         catch (const exception &exc)
+         {
+            failures[i] = exc.what();
+         }
+      });
+   }
+   else
+   {
+      for (size_t i = 0; i < segments.size(); ++i)
+      {
+         try
+         {
+            decode_segment(words_rev, segment_name(input_file, i), out.rdbuf(), segments[i]);
+         }
+         catch (const exception &exc)
+         {
+            failures[i] = exc.what();
+            break; // the following segments would be misplaced in a stream
+         }
+      }
+   }
+
+   size_t failed = 0;
+   for (size_t i = 0; i < failures.size(); ++i)
+   {
+      if (not failures[i].empty())
+      {
+         cerr << "segment " << i << ": " << failures[i] << '\n';
+         ++failed;
+      }
+   }
+   if (failed)
+   {
+      ostringstream msg;
+      msg << failed << " of " << segments.size() << " segments failed";
+      throw error(__FILE__, __LINE__, msg.str());
+   }
+   clog << segments.size() << " segments decoded\n";
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Encodes the input into independently decodable segments, named after the
+// output file with a suffix .0, .1, ... and writes to out an encoded manifest
+// which lists their order, sizes and final MACs.
+// The input is split in `count` segments, or in segments of segment_size bytes
+// when count is 0. Named seekable inputs are encoded with `threads` threads.
+void encode_segments(const word_list &words,
+                     const std::string &input_file, std::istream &in,
+                     const std::string &output_file, std::ostream &out,
+                     std::size_t count, std::streamsize segment_size, unsigned threads);
+
+// Decodes the manifest read from in and the segments next to input_file,
+// checking that each one is complete and in its place, then reassembles them.
+// When output_file is a named file, the segments are decoded in parallel.
+void decode_segments(const word_index &words_rev,
+                     const std::string &input_file, std::istream &in,
+                     const std::string &output_file, std::ostream &out,
+                     unsigned threads);
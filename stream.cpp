@@ -0,0 +1,128 @@
+#include "stream.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+// the frames written so far and the MAC state they end with
+class frame_writer
+{
+   const word_list &words;
+   ostream &out;
+   uint32 mac_state[CbcMac::stateSize];
+   size_t count = 0;
+
+public:
+   frame_writer(const word_list &words, ostream &out)
+      : words(words), out(out)
+   {
+      initial_mac_state(mac_state);
+   }
+
+   void write(const char *data, const streamsize size)
+   {
+      Encoder encoder(words, out);
+      encoder.resume(mac_state, 0);
+      encoder.write(data, size);
+      encoder.finish();
+      copy(begin(encoder.macState()), end(encoder.macState()), mac_state);
+      if (not out.flush())
+      {
+         throw error(__FILE__, __LINE__, "cannot write the output");
+      }
+      ++count;
+   }
+
+   size_t frames() const { return count; }
+};
+
+}
+
+void encode_stream(const word_list &words, const int fd, ostream &out,
+                   const streamsize frame_bytes, const int frame_ms)
+{
+   typedef chrono::steady_clock clock;
+   frame_writer writer(words, out);
+   vector<char> pending(frame_bytes);
+   streamsize size = 0;
+   clock::time_point deadline;
+   for (;;)
+   {
+      int timeout = -1; // nothing pending, wait for data
+      if (size > 0)
+      {
+         const auto left = chrono::duration_cast<chrono::milliseconds>(deadline - clock::now()).count();
+         timeout = static_cast<int>(std::max<decltype(left)>(left, 0));
+      }
+      pollfd p = {fd, POLLIN, 0};
+      const int ready = poll(&p, 1, timeout);
+      if (ready < 0)
+      {
+         if (errno == EINTR) continue;
+         throw error(__FILE__, __LINE__, string("cannot wait for the input: ") + strerror(errno));
+      }
+      if (ready == 0)
+      { // the producer is slow: flush what it gave
+         writer.write(pending.data(), size);
+         size = 0;
+         continue;
+      }
+
+      const ssize_t n = read(fd, pending.data() + size, frame_bytes - size);
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
+         throw error(__FILE__, __LINE__, string("cannot read the input: ") + strerror(errno));
+      }
+      if (n == 0) break;
+      if (size == 0)
+      {
+         deadline = clock::now() + chrono::milliseconds(frame_ms);
+      }
+      size += n;
+      if (size == frame_bytes)
+      {
+         writer.write(pending.data(), size);
+         size = 0;
+      }
+   }
+   if (size > 0)
+   {
+      writer.write(pending.data(), size);
+   }
+   writer.write(nullptr, 0); // the end of the stream
+   clog << writer.frames() << " frames written\n";
+}
+
+void decode_stream(const word_index &words_rev, istream &in, ostream &out)
+{
+   uint32 mac_state[CbcMac::stateSize];
+   initial_mac_state(mac_state);
+   for (size_t frames = 0; ; ++frames)
+   {
+      if ((in >> ws).peek() == char_traits<char>::eof())
+      {
+         throw error(__FILE__, __LINE__, "the stream is truncated after " + to_string(frames) + " frames");
+      }
+      ostringstream plain;
+      decode_chained(words_rev, in, plain, mac_state);
+      const string data = plain.str();
+      if (data.empty())
+      {
+         clog << frames << " frames decoded\n";
+         return;
+      }
+      if (not out.write(data.data(), data.size()).flush())
+      {
+         throw error(__FILE__, __LINE__, "cannot write the output");
+      }
+   }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "encodetotext.hpp"
+
+// Encodes what comes from the file descriptor fd as a stream of frames, each
+// a message written and flushed as soon as frame_bytes bytes are pending or
+// frame_ms milliseconds after its first byte, so that the words of a slow
+// producer come out with a bounded latency. The MAC of each frame continues
+// from the end of the previous one, so that frames can't be dropped or
+// reordered, and an empty frame ends the stream.
+void encode_stream(const word_list &words, int fd, std::ostream &out,
+                   std::streamsize frame_bytes, int frame_ms);
+
+// Decodes the frames of encode_stream, writing and flushing the plaintext of
+// each one once its final MAC is checked. A stream without its empty frame
+// is truncated and fails after the frames before.
+void decode_stream(const word_index &words_rev, std::istream &in, std::ostream &out);
@@ -0,0 +1,97 @@
+#include "synthetic.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// splitmix64: each 8 bytes of random data are the mix of their index
+static uint64_t mix(uint64_t x)
+{
+   x += 0x9e3779b97f4a7c15u;
+   x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9u;
+   x = (x ^ x >> 27) * 0x94d049bb133111ebu;
+   return x ^ x >> 31;
+}
+
+void synthetic_data::fill(char *buffer, size_t size, uint64_t position) const
+{
+   if (k == pattern)
+   {
+      for (size_t i = 0; i < size; ++i)
+      {
+         buffer[i] = static_cast<char>(position + i + 'a');
+      }
+      return;
+   }
+
+   while (size > 0)
+   {
+      const uint64_t word = mix(seed ^ position / 8);
+      const size_t offset = position % 8;
+      const size_t n = std::min<size_t>(size, 8 - offset);
+      char bytes[8];
+      memcpy(bytes, &word, sizeof bytes);
+      memcpy(buffer, bytes + offset, n);
+      buffer += n;
+      size -= n;
+      position += n;
+   }
+}
+
+generator_streambuf::int_type generator_streambuf::underflow()
+{
+   if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+   if (position >= size) return traits_type::eof();
+   const size_t n = std::min<uint64_t>(sizeof buffer, size - position);
+   data.fill(buffer, n, position);
+   position += n;
+   setg(buffer, buffer, buffer + n);
+   return traits_type::to_int_type(*gptr());
+}
+
+generator_streambuf::pos_type generator_streambuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which)
+{
+   if (not (which & ios_base::in)) return pos_type(off_type(-1));
+   const off_type current = position - (egptr() - gptr());
+   const off_type target = off + (dir == ios_base::beg ? 0 : dir == ios_base::cur ? current : off_type(size));
+   if (target < 0 or uint64_t(target) > size) return pos_type(off_type(-1));
+   position = target;
+   setg(buffer, buffer, buffer);
+   return pos_type(target);
+}
+
+generator_streambuf::pos_type generator_streambuf::seekpos(pos_type pos, ios_base::openmode which)
+{
+   return seekoff(off_type(pos), ios_base::beg, which);
+}
+
+verifying_streambuf::int_type verifying_streambuf::overflow(int_type c)
+{
+   if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+   const char byte = traits_type::to_char_type(c);
+   xsputn(&byte, 1);
+   return c;
+}
+
+streamsize verifying_streambuf::xsputn(const char *s, const streamsize n)
+{
+   for (streamsize done = 0; done < n; )
+   {
+      if (position >= size)
+      { // more than the data
+         if (mismatch == no_mismatch) mismatch = position;
+         position += n - done;
+         break;
+      }
+      const size_t chunk = std::min<uint64_t>({sizeof expected, uint64_t(n - done), size - position});
+      data.fill(expected, chunk, position);
+      if (mismatch == no_mismatch and memcmp(expected, s + done, chunk) != 0)
+      {
+         mismatch = position + (std::mismatch(expected, expected + chunk, s + done).first - expected);
+      }
+      position += chunk;
+      done += chunk;
+   }
+   return n;
+}
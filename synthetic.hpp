@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <streambuf>
+
+// The data of the tests and benchmarks, made on the fly instead of held in
+// memory: the byte at position i only depends on i, so that the data can be
+// read again from anywhere and checked as it comes back.
+class synthetic_data
+{
+public:
+   enum kind
+   {
+      pattern, // 'a' + i, as the tests always used
+      random   // pseudo-random bytes, from a seed
+   };
+
+   explicit synthetic_data(kind k, std::uint64_t seed = 0)
+      : k(k), seed(seed)
+   {}
+
+   // writes the size bytes from position
+   void fill(char *buffer, std::size_t size, std::uint64_t position) const;
+
+private:
+   kind k;
+   std::uint64_t seed;
+};
+
+// reads size bytes of synthetic data, seekable
+class generator_streambuf: public std::streambuf
+{
+public:
+   generator_streambuf(const synthetic_data &data, std::uint64_t size)
+      : data(data), size(size)
+   {}
+
+protected:
+   int_type underflow() override;
+   pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+   pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+   const synthetic_data data;
+   const std::uint64_t size;
+   std::uint64_t position = 0; // of the end of the buffer
+   char buffer[1 << 16];
+};
+
+// compares what is written with size bytes of synthetic data
+class verifying_streambuf: public std::streambuf
+{
+public:
+   verifying_streambuf(const synthetic_data &data, std::uint64_t size)
+      : data(data), size(size)
+   {}
+
+   // all the data was written, and nothing else
+   bool matches() const { return mismatch == no_mismatch and position == size; }
+   // the number of bytes written and the first one which differs, if any
+   std::uint64_t written() const { return position; }
+   std::uint64_t first_mismatch() const { return mismatch; }
+
+protected:
+   int_type overflow(int_type c) override;
+   std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+private:
+   static constexpr std::uint64_t no_mismatch = ~std::uint64_t(0);
+   const synthetic_data data;
+   const std::uint64_t size;
+   std::uint64_t position = 0;
+   std::uint64_t mismatch = no_mismatch; // the first position which differs
+   char expected[1 << 16];
+};
@@ -1,4 +1,17 @@
+#include "archive.hpp"
+#include "batch.hpp"
+#include "bounded.hpp"
+#include "checkpoint.hpp"
 #include "encodetotext.hpp"
+#include "fdstream.hpp"
+#include "fixed.hpp"
+#include "incremental.hpp"
+#include "multi.hpp"
+#include "positional.hpp"
+#include "segments.hpp"
+#include "stream.hpp"
+#include "synthetic.hpp"
+#include "tune.hpp"
 
 #include <fstream>
 #include <iostream>
@@ -8,6 +21,13 @@
 #include <vector>
 #include <cstdlib>
 #include <string>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 
 using namespace std;
 
@@ -20,8 +40,989 @@ static void writeToFile(istream& data, const string& filename)
 }
 #endif
 
+// pushes bytes of random data through encode() and decode(), which are
+// connected by a pipe, and checks them as they come out: the memory used
+// doesn't depend on the size
+static int stream_test(const char *size_text)
+{
+   istringstream read_size(size_text);
+   uint64_t size;
+   read_size >> size;
+   if (read_size.fail())
+   {
+      cerr << "parameter bytes must be a number\n";
+      return 2;
+   }
+
+   word_list words;
+   if ( ! quick_start(words))
+   {
+      generate_words(words);
+      save_words(words);
+   }
+   load_static_key();
+   word_index words_rev(words);
+   words_rev.build_table();
+
+   int fds[2];
+   if (pipe(fds) != 0)
+   {
+      cerr << "cannot create a pipe\n";
+      return 5;
+   }
+   // when the decoder stops early, the encoder gets EPIPE instead of dying
+   signal(SIGPIPE, SIG_IGN);
+
+   const synthetic_data data(synthetic_data::random);
+   const auto start = chrono::steady_clock::now();
+   string encode_failure;
+   thread encoder([&]()
+   {
+      try
+      {
+         generator_streambuf in_buffer(data, size);
+         istream in(&in_buffer);
+         fd_ostreambuf out_buffer(fds[1]);
+         ostream out(&out_buffer);
+         out.exceptions(ios::badbit); // a failed write stops the encoder
+         encode(words, in, out);
+         out.flush();
+      }
+      catch (const exception& exc)
+      {
+         encode_failure = exc.what();
+      }
+      close(fds[1]);
+   });
+
+   verifying_streambuf result_buffer(data, size);
+   try
+   {
+      fd_istreambuf in_buffer(fds[0]);
+      istream in(&in_buffer);
+      ostream result(&result_buffer);
+      decode(words_rev, in, result);
+   }
+   catch (const exception& exc)
+   {
+      cerr << "error: " << exc.what() << endl;
+   }
+   // the encoder may still be writing if decode() failed: it must not block
+   close(fds[0]);
+   encoder.join();
+   if (not encode_failure.empty())
+   {
+      cerr << "error: " << encode_failure << endl;
+   }
+
+   const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+   if (result_buffer.matches())
+   {
+      cout << "PASSED\n";
+   }
+   else
+   {
+      cout << "FAILED: " << result_buffer.written() << " bytes decoded, the first wrong one at "
+         << result_buffer.first_mismatch() << '\n';
+   }
+   cout << size / seconds / 1e6 << " MB/s\n";
+   return 0;
+}
+
+// the plaintext of the checks which don't depend on the size: a few blocks
+static string check_plain()
+{
+   const synthetic_data pattern(synthetic_data::pattern);
+   string plain(2 * BUFFER_SIZE + 1234, '\0');
+   pattern.fill(&plain[0], plain.size(), 0);
+   return plain;
+}
+
+// plain encoded with key as encode() would with it loaded
+static string encode_with(const word_list &words, const string &plain, const cipher_key &key,
+                          const bool with_key_id = false)
+{
+   ostringstream out;
+   Encoder encoder(words, out);
+   encoder.use_key(key);
+   if (with_key_id)
+   {
+      encoder.use_key_id();
+   }
+   encoder.write(plain.data(), plain.size());
+   encoder.finish();
+   return out.str();
+}
+
+namespace {
+
+// a directory of its own under /tmp, removed with what is left in it
+class temporary_directory
+{
+public:
+   temporary_directory()
+   {
+      char name[] = "/tmp/testencode.XXXXXX";
+      if (mkdtemp(name) == nullptr)
+      {
+         throw error(__FILE__, __LINE__, "cannot create a temporary directory");
+      }
+      path = name;
+   }
+
+   ~temporary_directory()
+   {
+      error_code ignored;
+      filesystem::remove_all(path, ignored);
+   }
+
+   filesystem::path path;
+};
+
+// the first bytes of data, then an error as if reading the input had crashed
+class interrupted_streambuf: public streambuf
+{
+public:
+   interrupted_streambuf(const string &data, const size_t size) : data(data, 0, size)
+   {
+      setg(&this->data[0], &this->data[0], &this->data[0] + this->data.size());
+   }
+
+protected:
+   int_type underflow() override
+   {
+      throw error(__FILE__, __LINE__, "interrupted");
+   }
+
+private:
+   string data;
+};
+
+}
+
+// whether run throws
+template <class Run>
+static bool fails(Run run)
+{
+   try
+   {
+      run();
+   }
+   catch (const exception&)
+   {
+      return true;
+   }
+   return false;
+}
+
+// rekeying gives what encoding with the new key would, and only from the old key
+static void rekey_check(const word_list &words, const word_index &words_rev)
+{
+   const cipher_key old_key = {1, 2, 3, 4}, new_key = {5, 6, 7, 8};
+   const string plain = check_plain(), old_encoded = encode_with(words, plain, old_key);
+   istringstream in(old_encoded);
+   ostringstream out;
+   rekey(words, words_rev, old_key, new_key, in, out);
+   if (out.str() != encode_with(words, plain, new_key))
+   {
+      throw error(__FILE__, __LINE__, "not the encoding with the new key");
+   }
+   if (not fails([&]
+   {
+      istringstream in(old_encoded);
+      ostringstream out;
+      rekey(words, words_rev, new_key, old_key, in, out);
+   }))
+   {
+      throw error(__FILE__, __LINE__, "a wrong old key was taken");
+   }
+}
+
+// a word longer than 8 bytes fails at its 9th byte: the rest stays in the stream
+static void long_word_check(const word_list&, const word_index&)
+{
+   const string token(1 << 20, 'x');
+   istringstream in(token + " next");
+   small_string word;
+   if (in >> word or word != small_string(token.data(), small_string::size()))
+   {
+      throw error(__FILE__, __LINE__, "a long word was read");
+   }
+   in.clear();
+   string rest;
+   if (not (in >> rest) or rest.size() != token.size() - small_string::size())
+   {
+      throw error(__FILE__, __LINE__, "a long word was consumed");
+   }
+}
+
+// a stream with the id of a key which isn't loaded decodes once the keyring
+// lists that key, past an entry which can't be read
+static void keyring_check(const word_list &words, const word_index &words_rev)
+{
+   const cipher_key ring_key = {9, 10, 11, 12};
+   const string plain = check_plain(), encoded = encode_with(words, plain, ring_key, true);
+   const auto decoded = [&]
+   {
+      istringstream in(encoded);
+      ostringstream out;
+      decode(words_rev, in, out);
+      return out.str();
+   };
+   if (not fails(decoded))
+   {
+      throw error(__FILE__, __LINE__, "a key which isn't loaded was found");
+   }
+
+   const temporary_directory dir;
+   const string key_file = dir.path / "ring.key", keyring_file = dir.path / "encode.keyring";
+   {
+      ofstream key(key_file, ios::binary);
+      for (const uint32 x: ring_key)
+      { // big-endian, as make_key writes it
+         const uint32 bytes = htonl(x);
+         key.write(reinterpret_cast<const char*>(&bytes), sizeof bytes);
+      }
+      ofstream keyring(keyring_file);
+      keyring << (dir.path / "missing.key").string() << '\n' << key_file << '\n';
+   }
+   load_keyring(keyring_file);
+   if (decoded() != plain)
+   {
+      throw error(__FILE__, __LINE__, "the key of the keyring didn't decode");
+   }
+}
+
+static string read_file(const filesystem::path &path)
+{
+   ifstream in(path, ios::binary);
+   ostringstream contents;
+   contents << in.rdbuf();
+   return contents.str();
+}
+
+// the plaintext of an archive of one entry, as encode_archive makes it
+static string archive_of(const string &path, const string &contents)
+{
+   string plain = "encarch1";
+   const auto put = [&](const uint64_t value, const int bytes)
+   {
+      for (int i = bytes - 1; i >= 0; --i) plain += static_cast<char>(value >> 8 * i);
+   };
+   put(1, 4);
+   put(path.size(), 2);
+   plain += path;
+   put(contents.size(), 8);
+   return plain + contents;
+}
+
+// a directory comes back with its nested and empty files, or only the file
+// of an entry; an unknown entry, a truncated archive and a path out of the
+// directory, even through a link, fail without leaving any file
+static void archive_check(const word_list &words, const word_index &words_rev)
+{
+   const temporary_directory dir;
+   const filesystem::path source = dir.path / "source";
+   const struct
+   {
+      const char *path;
+      string contents;
+   } files[] = {
+      {"a.txt", "some text\n"},
+      {"sub/deeper/b.bin", check_plain()},
+      {"sub/empty", ""},
+   };
+   for (const auto &f: files)
+   {
+      filesystem::create_directories((source / f.path).parent_path());
+      ofstream(source / f.path, ios::binary) << f.contents;
+   }
+   string encoded;
+   {
+      ostringstream out;
+      encode_archive(words, source, out, cipher_id::xxtea, false);
+      encoded = out.str();
+   }
+   const auto extract = [&](const string &archive, const filesystem::path &target, const string &entry)
+   {
+      istringstream in(archive);
+      decode_archive(words_rev, in, target, entry);
+   };
+
+   extract(encoded, dir.path / "all", "");
+   for (const auto &f: files)
+   {
+      if (not filesystem::is_regular_file(dir.path / "all" / f.path) or read_file(dir.path / "all" / f.path) != f.contents)
+      {
+         throw error(__FILE__, __LINE__, string(f.path) + " didn't come back");
+      }
+   }
+
+   extract(encoded, dir.path / "one", "sub/deeper/b.bin");
+   if (read_file(dir.path / "one/sub/deeper/b.bin") != files[1].contents or filesystem::exists(dir.path / "one/a.txt")
+       or filesystem::exists(dir.path / "one/sub/empty"))
+   {
+      throw error(__FILE__, __LINE__, "not only the entry was extracted");
+   }
+   if (not fails([&] { extract(encoded, dir.path / "unknown", "sub"); }))
+   {
+      throw error(__FILE__, __LINE__, "an unknown entry was extracted");
+   }
+
+   const auto encoded_plain = [&](const string &plain)
+   {
+      istringstream in(plain);
+      ostringstream out;
+      encode(words, in, out);
+      return out.str();
+   };
+   string plain;
+   {
+      istringstream in(encoded);
+      ostringstream out;
+      decode(words_rev, in, out);
+      plain = out.str();
+   }
+   if (not fails([&] { extract(encoded_plain(plain.substr(0, plain.size() - 1)), dir.path / "truncated", ""); }))
+   {
+      throw error(__FILE__, __LINE__, "a truncated archive was extracted");
+   }
+
+   // the files of an archive which fails aren't left, even those before the failure
+   if (not fails([&] { extract(encoded.substr(0, encoded.rfind('.')), dir.path / "cut", ""); })
+       or not filesystem::is_empty(dir.path / "cut"))
+   {
+      throw error(__FILE__, __LINE__, "a cut archive left files");
+   }
+   filesystem::create_directories(dir.path / "linked");
+   filesystem::create_directories(dir.path / "outside");
+   filesystem::create_directory_symlink(dir.path / "outside", dir.path / "linked/sub");
+   if (not fails([&] { extract(encoded, dir.path / "linked", ""); }) or not filesystem::is_empty(dir.path / "outside")
+       or filesystem::exists(dir.path / "linked/a.txt"))
+   {
+      throw error(__FILE__, __LINE__, "an archive was extracted through a symbolic link");
+   }
+
+   const string absolute = (dir.path / "absolute").string();
+   for (const string &path: {string("../x"), string("sub/../../x"), absolute})
+   {
+      if (not fails([&] { extract(encoded_plain(archive_of(path, "out")), dir.path / "unsafe", ""); })
+          or filesystem::exists(dir.path / "x") or filesystem::exists(absolute))
+      {
+         throw error(__FILE__, __LINE__, "the path " + path + " was extracted");
+      }
+   }
+   extract(encoded_plain(archive_of("in/x", "in")), dir.path / "safe", "");
+   if (read_file(dir.path / "safe/in/x") != "in")
+   {
+      throw error(__FILE__, __LINE__, "a handmade archive didn't come back");
+   }
+}
+
+// appending pieces of the data to an encoded file gives the encoding of all
+// of it, from the state saved by the last append or without it
+static void append_check(const word_list &words, const word_index &words_rev)
+{
+   const string plain = check_plain();
+   string expected;
+   {
+      istringstream in(plain);
+      ostringstream out;
+      encode(words, in, out);
+      expected = out.str();
+   }
+   const temporary_directory dir;
+   const string file = dir.path / "appended.txt";
+   for (const bool with_state: {true, false})
+   {
+      filesystem::remove(file);
+      const size_t ends[] = {15000, BUFFER_SIZE + 5000, plain.size()};
+      size_t begin = 0;
+      for (const size_t end: ends)
+      {
+         if (not with_state)
+         {
+            filesystem::remove(file + ".append");
+         }
+         istringstream in(plain.substr(begin, end - begin));
+         ofstream out(file, ios::binary | ios::in);
+         if (not out)
+         {
+            out.clear();
+            out.open(file, ios::binary);
+         }
+         encode_append(words, words_rev, in, file, out);
+         begin = end;
+      }
+      if (read_file(file) != expected)
+      {
+         throw error(__FILE__, __LINE__, with_state ? "not the encoding with the append state"
+                                                    : "not the encoding without the append state");
+      }
+   }
+}
+
+// an encoding interrupted after a checkpoint resumes to the encoding of all
+// the data, and only with the input and the output of the checkpoint
+static void resume_check(const word_list &words, const word_index&)
+{
+   const string plain = check_plain();
+   string expected;
+   {
+      istringstream in(plain);
+      ostringstream out;
+      encode(words, in, out);
+      expected = out.str();
+   }
+   const temporary_directory dir;
+   const string input = dir.path / "plain.bin", output = dir.path / "encoded.txt";
+   {
+      ofstream out(input, ios::binary);
+      out << plain;
+   }
+   {
+      interrupted_streambuf interrupted(plain, BUFFER_SIZE + 1000);
+      istream in(&interrupted);
+      in.exceptions(ios::badbit);
+      ofstream out(output, ios::binary);
+      if (not fails([&] { encode_with_checkpoints(words, input, in, output, out, BUFFER_SIZE, false); }))
+      {
+         throw error(__FILE__, __LINE__, "the interrupted encoding completed");
+      }
+   }
+   const auto resume = [&]
+   {
+      ifstream in(input, ios::binary);
+      ofstream out(output, ios::binary | ios::in);
+      encode_with_checkpoints(words, input, in, output, out, BUFFER_SIZE, true);
+   };
+
+   const auto mtime = filesystem::last_write_time(input);
+   filesystem::last_write_time(input, mtime + chrono::seconds(1));
+   if (not fails(resume))
+   {
+      throw error(__FILE__, __LINE__, "resumed from the checkpoint of a changed input");
+   }
+   filesystem::last_write_time(input, mtime);
+
+   const string written = read_file(output);
+   {
+      fstream out(output, ios::binary | ios::in | ios::out);
+      out.put(written[0] == 'a' ? 'b' : 'a');
+   }
+   if (not fails(resume))
+   {
+      throw error(__FILE__, __LINE__, "resumed from the checkpoint of a changed output");
+   }
+   {
+      fstream out(output, ios::binary | ios::in | ios::out);
+      out.put(written[0]);
+   }
+
+   resume();
+   if (read_file(output) != expected)
+   {
+      throw error(__FILE__, __LINE__, "not the encoding of the whole input");
+   }
+   if (filesystem::exists(output + ".checkpoint"))
+   {
+      throw error(__FILE__, __LINE__, "the checkpoint is left after the encoding");
+   }
+}
+
+// encoding with a base, after a change in one of its blocks, gives the
+// encoding of the new data, from the block list of the base or without it
+static void incremental_check(const word_list &words, const word_index &words_rev)
+{
+   const temporary_directory dir;
+   string plain = check_plain();
+   string base_plain = dir.path / "plain.0", base_encoded = dir.path / "encoded.0";
+   {
+      ofstream plain_out(base_plain, ios::binary), encoded_out(base_encoded, ios::binary);
+      plain_out << plain;
+      istringstream in(plain);
+      encode(words, in, encoded_out);
+   }
+   // the first change has no block list to start from
+   const size_t changes[] = {BUFFER_SIZE + 100, 100, 2 * BUFFER_SIZE + 100};
+   for (size_t i = 0; i < sizeof changes / sizeof *changes; ++i)
+   {
+      plain[changes[i]] ^= 1;
+      const string next_plain = dir.path / ("plain." + to_string(i + 1));
+      const string next_encoded = dir.path / ("encoded." + to_string(i + 1));
+      {
+         ofstream plain_out(next_plain, ios::binary), out(next_encoded, ios::binary);
+         plain_out << plain;
+         istringstream in(plain);
+         encode_incremental(words, words_rev, in, next_encoded, out, base_encoded, base_plain);
+      }
+      istringstream in(plain);
+      ostringstream expected;
+      encode(words, in, expected);
+      if (read_file(next_encoded) != expected.str())
+      {
+         throw error(__FILE__, __LINE__, "not the encoding of the changed data at " + to_string(changes[i]));
+      }
+      base_plain = next_plain;
+      base_encoded = next_encoded;
+   }
+}
+
+// segments decode to the data, in parallel into a file or in a stream, and
+// only each in its place in the manifest
+static void segments_check(const word_list &words, const word_index &words_rev)
+{
+   const string plain = check_plain();
+   const temporary_directory dir;
+   const string input = dir.path / "plain.bin", manifest = dir.path / "manifest.txt";
+   const string output = dir.path / "decoded.bin";
+   {
+      ofstream plain_out(input, ios::binary);
+      plain_out << plain;
+   }
+   {
+      ifstream in(input, ios::binary);
+      ofstream out(manifest, ios::binary);
+      encode_segments(words, input, in, manifest, out, 3, 0, 2);
+   }
+   {
+      ifstream in(manifest, ios::binary);
+      ofstream out(output, ios::binary);
+      decode_segments(words_rev, manifest, in, output, out, 2);
+   }
+   if (read_file(output) != plain)
+   {
+      throw error(__FILE__, __LINE__, "the segments don't decode in parallel to the data");
+   }
+   const auto decoded = [&]
+   {
+      ifstream in(manifest, ios::binary);
+      ostringstream out;
+      decode_segments(words_rev, manifest, in, "-", out, 1);
+      return out.str();
+   };
+   if (decoded() != plain)
+   {
+      throw error(__FILE__, __LINE__, "the segments don't decode in a stream to the data");
+   }
+
+   // segments 1 and 2 have the same size: only their MACs tell them apart
+   filesystem::rename(manifest + ".1", manifest + ".swap");
+   filesystem::rename(manifest + ".2", manifest + ".1");
+   filesystem::rename(manifest + ".swap", manifest + ".2");
+   if (not fails(decoded))
+   {
+      throw error(__FILE__, __LINE__, "swapped segments were decoded");
+   }
+}
+
+// a stream of frames decodes to the data, and fails when it ends at the end
+// of a frame before its empty one or when a frame is dropped
+static void stream_frames_check(const word_list &words, const word_index &words_rev)
+{
+   const string plain = check_plain();
+   const temporary_directory dir;
+   const string input = dir.path / "plain.bin";
+   {
+      ofstream out(input, ios::binary);
+      out << plain;
+   }
+   const int fd = open(input.c_str(), O_RDONLY);
+   if (fd < 0)
+   {
+      throw error(__FILE__, __LINE__, "cannot open " + input);
+   }
+   ostringstream out;
+   try
+   {
+      encode_stream(words, fd, out, 10000, 1000);
+   }
+   catch (...)
+   {
+      close(fd);
+      throw;
+   }
+   close(fd);
+   const string encoded = out.str();
+
+   const auto decoded = [&](const string &text)
+   {
+      istringstream in(text);
+      ostringstream plain_out;
+      decode_stream(words_rev, in, plain_out);
+      return plain_out.str();
+   };
+   if (decoded(encoded) != plain)
+   {
+      throw error(__FILE__, __LINE__, "the frames don't decode to the data");
+   }
+
+   // the end of frame n, after the words of its final MAC
+   const auto frame_end = [&](const size_t n)
+   {
+      size_t end = 0;
+      for (size_t i = 0; i <= n; ++i)
+      {
+         end = encoded.find('.', end) + 1;
+      }
+      for (size_t i = 0; i < mac_words().size(); ++i)
+      {
+         end = encoded.find_first_of(" \n", encoded.find_first_not_of(" \n", end));
+      }
+      return end;
+   };
+   const size_t frames = count(encoded.begin(), encoded.end(), '.');
+   if (frames != 6 or frame_end(frames - 1) != encoded.find_last_not_of(" \n") + 1)
+   {
+      throw error(__FILE__, __LINE__, "not the expected frames");
+   }
+   if (not fails([&] { decoded(encoded.substr(0, frame_end(frames - 2))); }))
+   {
+      throw error(__FILE__, __LINE__, "a stream without its empty frame was decoded");
+   }
+   if (not fails([&] { decoded(encoded.substr(0, frame_end(0)) + encoded.substr(frame_end(1))); }))
+   {
+      throw error(__FILE__, __LINE__, "a stream without one of its frames was decoded");
+   }
+}
+
+// the blocks written at once by several threads give the encoding of encode(),
+// whether the data ends in a partial block, a whole block or is empty
+static void parallel_check(const word_list &words, const word_index&)
+{
+   const temporary_directory dir;
+   const string output = dir.path / "encoded.txt";
+   const string data = check_plain() + check_plain();
+   for (const size_t size: {data.size(), size_t(4 * BUFFER_SIZE), size_t(0)})
+   {
+      const string plain = data.substr(0, size);
+      istringstream expected_in(plain), in(plain);
+      ostringstream expected;
+      const mac_words expected_mac = encode(words, expected_in, expected);
+      if (encode_positional(words, in, output, 3) != expected_mac or read_file(output) != expected.str())
+      {
+         throw error(__FILE__, __LINE__, "not the encoding of " + to_string(size) + " bytes");
+      }
+   }
+}
+
+// messages encoded one after the other decode to their data, in order or
+// split, and one which fails is left out without the others
+static void multi_check(const word_list &words, const word_index &words_rev)
+{
+   const string plain = check_plain();
+   const string plains[] = {plain, "a short message", plain.substr(5000, 25000)};
+   string encoded[3];
+   for (size_t i = 0; i < 3; ++i)
+   {
+      istringstream in(plains[i]);
+      ostringstream out;
+      encode(words, in, out);
+      encoded[i] = out.str();
+   }
+
+   const temporary_directory dir;
+   const string output = dir.path / "decoded";
+   const auto decoded = [&](const bool split)
+   {
+      istringstream in(encoded[0] + encoded[1] + encoded[2]);
+      ostringstream out;
+      decode_multi(words_rev, in, output, out, split, 2);
+      return out.str();
+   };
+   if (decoded(false) != plains[0] + plains[1] + plains[2])
+   {
+      throw error(__FILE__, __LINE__, "the messages don't decode to their data");
+   }
+   decoded(true);
+   for (size_t i = 0; i < 3; ++i)
+   {
+      if (read_file(output + '.' + to_string(i)) != plains[i])
+      {
+         throw error(__FILE__, __LINE__, "message " + to_string(i) + " isn't split to its data");
+      }
+   }
+
+   // a letter of a word of the second message
+   const size_t changed = encoded[1].find_first_of("abcdefghijklmnopqrstuvwxyz", encoded[1].find(',') + 1);
+   encoded[1][changed] = encoded[1][changed] == 'a' ? 'b' : 'a';
+   istringstream in(encoded[0] + encoded[1] + encoded[2]);
+   ostringstream out;
+   if (not fails([&] { decode_multi(words_rev, in, output, out, false, 2); }))
+   {
+      throw error(__FILE__, __LINE__, "a changed message was decoded");
+   }
+   if (out.str() != plains[0] + plains[2])
+   {
+      throw error(__FILE__, __LINE__, "not the messages around the changed one");
+   }
+}
+
+// with a cache, repeated blocks give the same encoding, which decodes with
+// a cache to the data, for each cipher
+static void dedup_check(const word_list &words, const word_index &words_rev)
+{
+   const string a = check_plain().substr(0, BUFFER_SIZE);
+   string b = a;
+   b[100] ^= 1;
+   const string data = a + b + a + a + a.substr(0, 1234);
+   for (const cipher_id cipher: {cipher_id::xxtea, cipher_id::aes})
+   {
+      if (cipher == cipher_id::aes and not aes_available()) continue;
+      istringstream expected_in(data), in(data);
+      ostringstream expected, out;
+      encode(words, expected_in, expected, nullptr, cipher, true);
+      block_cache encode_cache;
+      encode(words, in, out, &encode_cache, cipher, true);
+      if (out.str() != expected.str())
+      {
+         throw error(__FILE__, __LINE__, "not the encoding without the cache");
+      }
+      ostringstream report;
+      encode_cache.report(report);
+      if (report.str().compare(0, 14, "dedup: 2 of 4 ") != 0)
+      {
+         throw error(__FILE__, __LINE__, "not the repeated blocks: " + report.str());
+      }
+
+      istringstream encoded(out.str());
+      ostringstream decoded;
+      block_cache decode_cache;
+      decode(words_rev, encoded, decoded, &decode_cache);
+      if (decoded.str() != data)
+      {
+         throw error(__FILE__, __LINE__, "the encoding with the cache doesn't decode to the data");
+      }
+   }
+}
+
+// a batch runs its jobs on several threads, reports them in the order of the
+// manifest and leaves no output of a failed job
+static void batch_check(const word_list &words, const word_index&)
+{
+   const string plain = check_plain(), short_plain = "a short message";
+   string encoded, short_encoded;
+   {
+      istringstream in(plain), short_in(short_plain);
+      ostringstream out, short_out;
+      encode(words, in, out);
+      encode(words, short_in, short_out);
+      encoded = out.str();
+      short_encoded = short_out.str();
+   }
+   const temporary_directory dir;
+   const auto file = [&](const char *name) { return (dir.path / name).string(); };
+   const auto write = [](const string &name, const string &contents)
+   {
+      ofstream out(name, ios::binary);
+      out << contents;
+   };
+   write(file("plain"), plain);
+   write(file("short.txt"), short_encoded);
+   write(file("cut.txt"), encoded.substr(0, encoded.rfind('.')));
+
+   const string jobs[][3] = {
+      {"enc", file("plain"), file("plain.txt")},
+      {"dec", file("short.txt"), file("short")},
+      {"dec", file("cut.txt"), file("cut")},
+      {"enc", file("missing"), file("missing.txt")},
+   };
+   ostringstream manifest_text;
+   for (const auto &j: jobs)
+   {
+      manifest_text << j[0] << '\t' << j[1] << '\t' << j[2] << '\n';
+   }
+   istringstream manifest(manifest_text.str());
+   ostringstream report;
+   if (run_batch(words, manifest, report, 3) != 2)
+   {
+      throw error(__FILE__, __LINE__, "not the failed jobs");
+   }
+
+   istringstream report_in(report.str());
+   string line;
+   for (const auto &j: jobs)
+   {
+      const bool ok = j[1] == file("plain") or j[1] == file("short.txt");
+      const string expected = string(ok ? "ok" : "failed") + '\t' + j[1] + '\t' + j[2];
+      if (not getline(report_in, line) or line.compare(0, expected.size(), expected) != 0
+          or (ok and line.size() != expected.size()))
+      {
+         throw error(__FILE__, __LINE__, "not the report of " + j[1] + ": " + line);
+      }
+   }
+   if (read_file(file("plain.txt")) != encoded or read_file(file("short")) != short_plain)
+   {
+      throw error(__FILE__, __LINE__, "not the outputs of the jobs");
+   }
+   if (filesystem::exists(file("cut")) or filesystem::exists(file("missing.txt")))
+   {
+      throw error(__FILE__, __LINE__, "the output of a failed job is left");
+   }
+}
+
+// a profile sets the parameters of its valid lines, and the others keep
+// their defaults, as does a missing profile
+static void tuning_check(const word_list&, const word_index&)
+{
+   const temporary_directory dir;
+   const string file = dir.path / "encode.tune";
+   {
+      ofstream out(file);
+      out << "# written by calibrate\n"
+          << "threads 3\n"
+          << "threads 1025\n"        // out of range, after a valid one
+          << "fd-buffer 0\n"         // zero
+          << "short-input 4096x\n"   // not a number
+          << "short-input\n"         // without a value
+          << "speed 12\n";           // unknown
+   }
+   const tuning defaults, loaded = load_tuning(file);
+   if (loaded.threads != 3 or loaded.fd_buffer_size != defaults.fd_buffer_size
+       or loaded.short_input_size != defaults.short_input_size)
+   {
+      throw error(__FILE__, __LINE__, "not the parameters of the valid lines");
+   }
+   const tuning missing = load_tuning(dir.path / "missing.tune");
+   if (missing.threads != defaults.threads or missing.fd_buffer_size != defaults.fd_buffer_size
+       or missing.short_input_size != defaults.short_input_size)
+   {
+      throw error(__FILE__, __LINE__, "not the defaults without a profile");
+   }
+}
+
+// the limits of decode_bounded pass at the sizes of the input and the output,
+// and fail a byte below
+static void limits_check(const word_list &words, const word_index &words_rev)
+{
+   const string plain = check_plain();
+   for (const bool raw: {false, true})
+   {
+      string encoded;
+      {
+         istringstream in(plain);
+         ostringstream out;
+         raw ? encode_raw(in, out) : encode(words, in, out);
+         encoded = out.str();
+      }
+      const auto decoded = [&](const streamsize max_input, const streamsize max_output)
+      {
+         istringstream in(encoded);
+         ostringstream out;
+         decode_bounded(words_rev, in, out, max_input, max_output, raw);
+         return out.str();
+      };
+      const streamsize input_size = encoded.size(), output_size = plain.size();
+      if (decoded(input_size, output_size) != plain)
+      {
+         throw error(__FILE__, __LINE__, "the limits at the sizes failed");
+      }
+      if (not fails([&] { decoded(input_size - 1, 0); }) or not fails([&] { decoded(0, output_size - 1); }))
+      {
+         throw error(__FILE__, __LINE__, "the limits below the sizes passed");
+      }
+   }
+}
+
+// the bytes of a string of hexadecimal digits
+static string from_hex(const char *const hex)
+{
+   string bytes;
+   for (const char *p = hex; p[0] != '\0' and p[1] != '\0'; p += 2)
+   {
+      bytes += static_cast<char>(stoi(string(p, 2), nullptr, 16));
+   }
+   return bytes;
+}
+
+static const unsigned char *bytes_of(const string &s)
+{
+   return reinterpret_cast<const unsigned char*>(s.data());
+}
+
+// the AES modes give the known answers of FIPS-197, SP 800-38A, SP 800-38B
+// and RFC 5297, and the cipher refuses a block changed by a bit
+static void aes_vectors_check(const word_list&, const word_index&)
+{
+   if (not aes_available())
+   {
+      return;
+   }
+   const auto expect = [](const string &actual, const char *const expected, const char *const what)
+   {
+      if (actual != from_hex(expected))
+      {
+         throw error(__FILE__, __LINE__, string("wrong ") + what);
+      }
+   };
+
+   {
+      const string key = from_hex("000102030405060708090a0b0c0d0e0f");
+      const string plain = from_hex("00112233445566778899aabbccddeeff");
+      string out(16, '\0');
+      aes_encrypt_block(bytes_of(key), bytes_of(plain), reinterpret_cast<unsigned char*>(&out[0]));
+      expect(out, "69c4e0d86a7b0430d8cdb78070b4c55a", "FIPS-197 C.1 block");
+   }
+
+   const string key = from_hex("2b7e151628aed2a6abf7158809cf4f3c");
+   const string message = from_hex("6bc1bee22e409f96e93d7e117393172a" "ae2d8a571e03ac9c9eb76fac45af8e51"
+                                   "30c81c46a35ce411e5fbc1191a0a52ef" "f69f2445df4f9b17ad2b417be66c3710");
+   {
+      const string counter = from_hex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+      string data = message;
+      aes_ctr(bytes_of(key), bytes_of(counter), reinterpret_cast<unsigned char*>(&data[0]), data.size());
+      expect(data, "874d6191b620e3261bef6864990db6ce" "9806f66b7970fdff8617187bb9fffdff"
+                   "5ae4df3edbd5d35e5b4f09020db03eab" "1e031dda2fbe03d1792170a0f3009cee", "SP 800-38A F.5.1 CTR");
+   }
+
+   const struct
+   {
+      size_t size;
+      const char *tag;
+   } cmacs[] = {
+      {0, "bb1d6929e95937287fa37d129b756746"},
+      {16, "070a16b46b4d4144f79bdd9dd04a287c"},
+      {40, "dfa66747de9ae63030ca32611497c827"},
+      {64, "51f0bebf7e3b9d92fc49741779363cfe"},
+   };
+   for (const auto &c: cmacs)
+   {
+      string tag(16, '\0');
+      aes_cmac(bytes_of(key), bytes_of(message), c.size, reinterpret_cast<unsigned char*>(&tag[0]));
+      expect(tag, c.tag, "SP 800-38B D.1 CMAC");
+   }
+
+   {
+      const string siv_key = from_hex("fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0" "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+      const string ad = from_hex("101112131415161718191a1b1c1d1e1f2021222324252627");
+      const string plain = from_hex("112233445566778899aabbccddee");
+      string out(plain.size() + 16, '\0');
+      aes_siv_encrypt(bytes_of(siv_key), bytes_of(ad), ad.size(), bytes_of(plain), plain.size(),
+                      reinterpret_cast<unsigned char*>(&out[0]));
+      expect(out, "85632d07c6e8f37f950acd320a2ecc93" "40c02b9690c4dc04daef7f6afe5c", "RFC 5297 A.1 SIV");
+   }
+
+   const cipher_key stream_key = {1, 2, 3, 4};
+   const auto cipher = make_cipher(cipher_id::aes, stream_key);
+   const int n = 10, overhead = cipher->overhead();
+   uint32 block[n + 4] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+   cipher->crypt(block, n);
+   uint32 changed[n + 4];
+   copy(block, block + n + overhead, changed);
+   changed[n / 2] ^= 1;
+   if (cipher->crypt(changed, -n - overhead) or not cipher->crypt(block, -n - overhead) or block[n - 1] != 10)
+   {
+      throw error(__FILE__, __LINE__, "the cipher took a changed block or refused its own");
+   }
+}
+
 static int unit_tests(int argc, char *argv[])
 {
+   if (argc > 2 and string(argv[1]) == "stream")
+   {
+      return stream_test(argv[2]);
+   }
+
    streamsize start, stop;
    if (argc > 2)
    {
@@ -53,11 +1054,11 @@ static int unit_tests(int argc, char *argv[])
    }
    else
    {
-      cerr << "missing parameters: start, stop\n";
+      cerr << "missing parameters: start, stop or stream, bytes\n";
       return 1;
    }
 
-   vector<small_string> words;
+   word_list words;
    if ( ! quick_start(words))
    {
       generate_words(words);
@@ -65,9 +1066,46 @@ static int unit_tests(int argc, char *argv[])
    }
    load_static_key();
 
-   unordered_map<small_string, uint16_t> words_rev;
-   reverse_words(words, words_rev);
+   word_index words_rev(words);
+   words_rev.build_table();
 
+   // the checks which don't depend on the size, run once
+   const struct
+   {
+      const char *name;
+      void (*run)(const word_list &words, const word_index &words_rev);
+   } checks[] = {
+      {"rekey", rekey_check},
+      {"keyring", keyring_check},
+      {"archive", archive_check},
+      {"append", append_check},
+      {"resume", resume_check},
+      {"incremental", incremental_check},
+      {"segments", segments_check},
+      {"stream frames", stream_frames_check},
+      {"parallel", parallel_check},
+      {"multi", multi_check},
+      {"dedup", dedup_check},
+      {"batch", batch_check},
+      {"tuning", tuning_check},
+      {"long word", long_word_check},
+      {"limits", limits_check},
+      {"aes vectors", aes_vectors_check},
+   };
+   vector<string> check_failures;
+   for (const auto &check: checks)
+   {
+      try
+      {
+         check.run(words, words_rev);
+      }
+      catch (const exception& exc)
+      {
+         check_failures.push_back(string(check.name) + ": " + exc.what());
+      }
+   }
+
+   const synthetic_data pattern(synthetic_data::pattern);
    cerr << "starting tests..." << endl;
    vector<bool> results(stop - start);
    int progress = 0;
@@ -89,16 +1127,23 @@ static int unit_tests(int argc, char *argv[])
       }
    }
    cerr << "Using " << num_threads << " threads" << endl;
+   // the AES cipher is only tested where the CPU has its instructions
+   const bool has_aes = aes_available();
 
    // Create worker function for parallel execution
    auto worker = [&](int thread_id) {
       for (streamsize n = start + thread_id; n < stop; n += num_threads)
       { // test for size n (thread_id, thread_id+num_threads, thread_id+2*num_threads, ...)
-         stringstream in, out, result;
-         for (streamsize i = 0; i < n; ++i)
-         {
-            in << static_cast<char>(i + 'a');
-         }
+         generator_streambuf in_buffer(pattern, n);
+         istream in(&in_buffer);
+         stringstream out;
+         verifying_streambuf result_buffer(pattern, n), raw_result_buffer(pattern, n),
+            fixed_result_buffer(pattern, n), fixed_text_result_buffer(pattern, n),
+            aes_result_buffer(pattern, n);
+         ostream result(&result_buffer), raw_result(&raw_result_buffer),
+            fixed_result(&fixed_result_buffer), fixed_text_result(&fixed_text_result_buffer),
+            aes_result(&aes_result_buffer);
+         bool raw_matches = false, fixed_matches = false, aes_matches = not has_aes;
 
          try
          {
@@ -120,8 +1165,45 @@ static int unit_tests(int argc, char *argv[])
             out.clear();
             out.seekg(0);
             assert(0 == out.tellg());
-            assert(0 == result.tellp());
+            assert(0 == result_buffer.written());
             decode(words_rev, out, result);
+
+            /* the raw format renders to the same words and decodes the same */
+            in.clear();
+            in.seekg(0);
+            stringstream raw, rendered, unrendered;
+            encode_raw(in, raw);
+            render(words, raw, rendered);
+            out.clear();
+            out.seekg(0);
+            unrender(words_rev, out, unrendered);
+            raw.clear();
+            raw.seekg(0);
+            decode_raw(raw, raw_result);
+            raw_matches = rendered.str() == out.str() and unrendered.str() == raw.str()
+               and raw_result_buffer.matches();
+
+            /* the fixed width words decode both ways */
+            in.clear();
+            in.seekg(0);
+            stringstream fixed;
+            encode_fixed(words, in, fixed);
+            decode_fixed(words_rev, fixed, fixed_result, 1);
+            fixed.clear();
+            fixed.seekg(0);
+            decode(words_rev, fixed, fixed_text_result);
+            fixed_matches = fixed_result_buffer.matches() and fixed_text_result_buffer.matches();
+
+            /* the stream names its cipher for decode */
+            if (has_aes)
+            {
+               in.clear();
+               in.seekg(0);
+               stringstream aes;
+               encode(words, in, aes, nullptr, cipher_id::aes);
+               decode(words_rev, aes, aes_result);
+               aes_matches = aes_result_buffer.matches() and aes.str() != out.str();
+            }
          }
          catch (const exception& exc)
          {
@@ -131,7 +1213,7 @@ static int unit_tests(int argc, char *argv[])
 
          {
             lock_guard<mutex> lock(results_mutex);
-            results[n - start] = in.str() == result.str();
+            results[n - start] = result_buffer.matches() and raw_matches and fixed_matches and aes_matches;
          }
 
          /* display a progress bar (only from last thread for coherence) */
@@ -177,7 +1259,7 @@ static int unit_tests(int argc, char *argv[])
    }
 
    // Print appropriate header based on whether there were failures
-   if (failed == 0)
+   if (failed == 0 and check_failures.empty())
    {
       cout << "\nPASSED\n";
    }
@@ -195,6 +1277,10 @@ static int unit_tests(int argc, char *argv[])
          }
       }
       cout << '\n';
+      for (const string &f: check_failures)
+      {
+         cout << "check " << f << '\n';
+      }
    }
 
    cout << "failed " << (failed * 100 / total) << "%\n";
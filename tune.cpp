@@ -0,0 +1,253 @@
+#include "tune.hpp"
+#include "parallel.hpp"
+#include "synthetic.hpp"
+
+#include <charconv>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+typedef chrono::steady_clock tune_clock;
+
+static double microseconds_since(const tune_clock::time_point start)
+{
+   return chrono::duration<double, micro>(tune_clock::now() - start).count();
+}
+
+// a measure is the best of a few runs: the others were disturbed
+template <class Run>
+static double best_of(const int runs, Run run)
+{
+   double best = 0;
+   for (int i = 0; i < runs; ++i)
+   {
+      const auto start = tune_clock::now();
+      run();
+      const double us = microseconds_since(start);
+      if (i == 0 or us < best) best = us;
+   }
+   return best;
+}
+
+// value is left as is unless text is a number in (0, largest]
+template <class T>
+static bool parse_value(const string &text, T &value, const T largest)
+{
+   T number;
+   const auto result = from_chars(text.data(), text.data() + text.size(), number);
+   if (result.ec != errc() or result.ptr != text.data() + text.size() or number <= 0 or number > largest)
+   {
+      return false;
+   }
+   value = number;
+   return true;
+}
+
+tuning load_tuning(const string &file)
+{
+   tuning t;
+   ifstream in(file);
+   string line;
+   for (size_t number = 1; getline(in, line); ++number)
+   {
+      if (line.empty() or line[0] == '#') continue;
+      const size_t blank = line.find(' ');
+      const string name = line.substr(0, blank), value = blank == string::npos ? "" : line.substr(blank + 1);
+      const bool valid = name == "threads" ? parse_value(value, t.threads, 1024u)
+         : name == "fd-buffer" ? parse_value(value, t.fd_buffer_size, size_t(1) << 30)
+         : name == "short-input" ? parse_value(value, t.short_input_size, streamoff(1) << 40)
+         : false;
+      if (not valid)
+      { // the default stays: a profile from another version still works
+         cerr << "warning: " << file << " line " << number << " ignored: " << line << '\n';
+      }
+   }
+   return t;
+}
+
+// the number of threads from which adding threads doesn't pay: SMT siblings
+// and shared caches differ between hosts
+static unsigned calibrate_threads(const word_list &words)
+{
+   const unsigned cores = default_threads(0);
+   constexpr size_t nb_blocks = 256;
+   const synthetic_data random(synthetic_data::random);
+   vector<char> data(nb_blocks * BUFFER_SIZE);
+   random.fill(data.data(), data.size(), 0);
+
+   unsigned best_threads = 1;
+   double best_us = 0;
+   for (unsigned threads = 1; ; threads = std::min(cores, threads * 2))
+   {
+      const double us = best_of(2, [&]
+      {
+         parallel_for(nb_blocks, threads, [&](const size_t i)
+         { // the work of an encoder on a block
+            const block_buffer block;
+            streamsize size = BUFFER_SIZE;
+            memcpy(block.data(), data.data() + i * BUFFER_SIZE, size);
+            const streamsize natives = pad_and_crypt(block.data(), size);
+            string text(natives * 2 * (small_string::size() + 1) + small_string::size(), '\0');
+            render_block(words, block.data(), natives, &text[0]);
+         });
+      });
+      clog << "threads " << threads << ": " << nb_blocks * BUFFER_SIZE / us << " MB/s\n";
+      // a few more threads must save more than the noise of the measure
+      if (threads == 1 or us < best_us * 0.95)
+      {
+         best_threads = threads;
+         best_us = us;
+      }
+      if (threads == cores) break;
+   }
+   return best_threads;
+}
+
+// the buffer of stdin and stdout which moves data through a pipe the fastest
+static size_t calibrate_fd_buffer()
+{
+   constexpr size_t total = 64 << 20;
+   size_t best_size = default_fd_buffer_size;
+   double best_us = 0;
+   for (const size_t size: {size_t(64) << 10, size_t(256) << 10, size_t(1) << 20, size_t(4) << 20})
+   {
+      const double us = best_of(2, [&]
+      {
+         int fds[2];
+         if (pipe(fds) != 0)
+         {
+            throw error(__FILE__, __LINE__, "cannot create a pipe");
+         }
+         exception_ptr read_failure;
+         thread reader;
+         try
+         {
+            reader = thread([&]
+            {
+               try
+               {
+                  fd_istreambuf buffer(fds[0], size);
+                  char sink[64 << 10];
+                  while (buffer.sgetn(sink, sizeof sink) > 0) {}
+               }
+               catch (...)
+               {
+                  read_failure = current_exception();
+               }
+               close(fds[0]);
+            });
+            fd_ostreambuf buffer(fds[1], size);
+            const string chunk(64 << 10, 'x');
+            for (size_t written = 0; written < total; written += chunk.size())
+            {
+               if (buffer.sputn(chunk.data(), chunk.size()) != streamsize(chunk.size()))
+               {
+                  throw error(__FILE__, __LINE__, "cannot write to the pipe");
+               }
+            }
+         }
+         catch (...)
+         { // the end of the pipe stops the reader, which must be joined
+            close(fds[1]);
+            if (reader.joinable()) reader.join();
+            else close(fds[0]);
+            throw;
+         }
+         close(fds[1]);
+         reader.join();
+         if (read_failure) rethrow_exception(read_failure);
+      });
+      clog << "fd buffer " << size << ": " << total / us << " MB/s\n";
+      if (best_us == 0 or us < best_us)
+      {
+         best_size = size;
+         best_us = us;
+      }
+   }
+   return best_size;
+}
+
+// the size of encoded input above which building the table of word_index
+// takes less time than it saves on the search of the words
+static streamoff calibrate_short_input(const word_list &words)
+{
+   string encoded;
+   {
+      const synthetic_data random(synthetic_data::random);
+      generator_streambuf data(random, 256 << 10);
+      istream in(&data);
+      ostringstream out;
+      encode(words, in, out);
+      encoded = out.str();
+   }
+   const double build_us = best_of(3, [&]
+   {
+      word_index hashed(words);
+      hashed.build_table();
+   });
+   const word_index searched(words);
+   word_index hashed(words);
+   hashed.build_table();
+   const auto decode_us = [&](const word_index &index)
+   {
+      return best_of(2, [&]
+      {
+         istringstream in(encoded);
+         ostringstream out;
+         decode(index, in, out);
+      });
+   };
+   const double search_us = decode_us(searched), table_us = decode_us(hashed);
+   clog << "word index: table built in " << build_us << " us, decoding "
+      << encoded.size() / search_us << " MB/s searched, " << encoded.size() / table_us << " MB/s with the table\n";
+
+   constexpr streamoff smallest = 16 << 10, largest = 64 << 20;
+   if (search_us <= table_us) return largest;
+   return std::max(smallest, std::min(largest, streamoff(build_us * encoded.size() / (search_us - table_us))));
+}
+
+// reported only: the cipher is a property of the encoded stream
+static void report_ciphers(const word_list &words)
+{
+   constexpr size_t size = 4 << 20;
+   const synthetic_data random(synthetic_data::random);
+   for (const cipher_id cipher: {cipher_id::xxtea, cipher_id::aes})
+   {
+      if (cipher == cipher_id::aes and not aes_available()) continue;
+      const double us = best_of(2, [&]
+      {
+         generator_streambuf data(random, size);
+         istream in(&data);
+         ostringstream out;
+         encode(words, in, out, nullptr, cipher);
+      });
+      clog << "cipher " << cipher_name(cipher) << ": encoding " << size / us << " MB/s\n";
+   }
+}
+
+tuning calibrate(const word_list &words, const string &file)
+{
+   tuning t;
+   t.threads = calibrate_threads(words);
+   t.fd_buffer_size = calibrate_fd_buffer();
+   t.short_input_size = calibrate_short_input(words);
+   report_ciphers(words);
+
+   ofstream out(file);
+   out << "# the parameters of this host, measured by encode calibrate\n"
+      << "threads " << t.threads << '\n'
+      << "fd-buffer " << t.fd_buffer_size << '\n'
+      << "short-input " << t.short_input_size << '\n';
+   if (not out.flush())
+   {
+      throw error(__FILE__, __LINE__, "cannot write " + file);
+   }
+   clog << file << " written\n";
+   return t;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "encodetotext.hpp"
+#include "fdstream.hpp"
+
+// The parameters which depend on the host, as measured by calibrate.
+// The defaults are safe on any host.
+struct tuning
+{
+   unsigned threads = 0;                             // 0 for one thread per core
+   std::size_t fd_buffer_size = default_fd_buffer_size; // of stdin and stdout
+   std::streamoff short_input_size = 128 << 10;      // decoded without the table of word_index
+};
+
+// the profile of the host, written by calibrate
+constexpr char default_tuning_file[] = "encode.tune";
+
+// Reads a profile of lines `name value': threads, fd-buffer, short-input.
+// A missing file gives the defaults, an invalid line is reported and skipped.
+tuning load_tuning(const std::string &file = default_tuning_file);
+// Measures the parameters on this host with the loaded key, writes them to
+// file and returns them. The speed of each cipher is reported too, but the
+// cipher stays the choice of enc since it changes the encoded stream.
+tuning calibrate(const word_list &words, const std::string &file = default_tuning_file);